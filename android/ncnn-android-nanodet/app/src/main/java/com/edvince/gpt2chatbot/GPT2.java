@@ -19,9 +19,17 @@ import android.view.Surface;
 
 public class GPT2
 {
-    public native boolean loadGPT2(AssetManager mgr, String vocab);
+    // cacheDir keeps the weights prepacked for this cpu between starts
+    public native boolean loadGPT2(AssetManager mgr, String cacheDir);
     public native String chat(String in);
 
+    // returns a stream handle at once, 0 on failure, a new chat cancels the running one
+    public native long chatAsync(String in, int timeoutMs);
+    // text generated since the last call, "" if none came within timeoutMs, null once the reply is complete
+    public native String readStream(long handle, int timeoutMs);
+    public native void cancelStream(long handle);
+    public native void releaseStream(long handle);
+
     static {
         System.loadLibrary("gpt2chat");
     }
@@ -16,7 +16,6 @@ package com.edvince.gpt2chatbot;
 
 import android.Manifest;
 import android.app.Activity;
-import android.content.Context;
 import android.content.pm.PackageManager;
 import android.graphics.PixelFormat;
 import android.os.Bundle;
@@ -39,10 +38,6 @@ import android.widget.TextView;
 
 import com.edvince.gpt2chatbot.GPT2;
 
-import java.io.File;
-import java.io.FileOutputStream;
-import java.io.InputStream;
-
 public class MainActivity extends Activity implements SurfaceHolder.Callback
 {
     private GPT2 gpt2 = new GPT2();
@@ -50,6 +45,8 @@ public class MainActivity extends Activity implements SurfaceHolder.Callback
     private Button sendButton;
     private TextView showText;
     private EditText inText;
+    // the reply being generated, touched on the ui thread only
+    private long stream = 0;
 
     /** Called when the activity is first created. */
     @Override
@@ -64,7 +61,6 @@ public class MainActivity extends Activity implements SurfaceHolder.Callback
         showText.setGravity(Gravity.BOTTOM);
         showText.getBackground().setAlpha(100);
         showText.append("欢迎使用GPT2中文抽风聊天机器人(powered by ncnn)\n");
-        showText.append("尽量输入中文，英文分词目前有点问题\n");
         showText.append("开始聊天吧！试着输入\"你好\"\n\n");
         inText = (EditText) findViewById(R.id.inText);
         sendButton = (Button) findViewById(R.id.sendBtn);
@@ -73,9 +69,42 @@ public class MainActivity extends Activity implements SurfaceHolder.Callback
             public void onClick(View arg0) {
                 String input = inText.getText().toString();
                 showText.append("user: "+input+"\n");
-                String output = gpt2.chat(input);
-                showText.append("chatbot: "+output+"\n");
+                showText.append("chatbot: ");
                 inText.getText().clear();
+
+                final long handle = gpt2.chatAsync(input, 60000);
+                if (handle == 0) {
+                    showText.append("\n");
+                    return;
+                }
+                stream = handle;
+                sendButton.setEnabled(false);
+
+                // the reply shows up piece by piece, the ui thread never waits for the model
+                new Thread(new Runnable() {
+                    @Override
+                    public void run() {
+                        String piece;
+                        while ((piece = gpt2.readStream(handle, -1)) != null) {
+                            final String text = piece;
+                            runOnUiThread(new Runnable() {
+                                @Override
+                                public void run() {
+                                    showText.append(text);
+                                }
+                            });
+                        }
+                        runOnUiThread(new Runnable() {
+                            @Override
+                            public void run() {
+                                showText.append("\n");
+                                gpt2.releaseStream(handle);
+                                stream = 0;
+                                sendButton.setEnabled(true);
+                            }
+                        });
+                    }
+                }).start();
             }
         });
 
@@ -83,40 +112,12 @@ public class MainActivity extends Activity implements SurfaceHolder.Callback
     }
 
     private void reload() {
-
-        String path = MainActivity.this.getFilesDir().getAbsolutePath();
-        String name = "vocab.txt";
-        copy(MainActivity.this, name, path, name);
-        String file = path+File.separator+name;
-
-        boolean ret_init = gpt2.loadGPT2(getAssets(), file);
+        boolean ret_init = gpt2.loadGPT2(getAssets(), getCacheDir().getAbsolutePath());
         if (!ret_init) {
             Log.e("MainActivity", "loadModel failed");
         }
     }
 
-    private void copy(Context myContext, String ASSETS_NAME, String savePath, String saveName) {
-        String filename = savePath + "/" + saveName;
-        File dir = new File(savePath);
-        if (!dir.exists())
-            dir.mkdir();
-        try {
-            if (!(new File(filename)).exists()) {
-                InputStream is = myContext.getResources().getAssets().open(ASSETS_NAME);
-                FileOutputStream fos = new FileOutputStream(filename);
-                byte[] buffer = new byte[7168];
-                int count = 0;
-                while ((count = is.read(buffer)) > 0) {
-                    fos.write(buffer, 0, count);
-                }
-                fos.close();
-                is.close();
-            }
-        } catch (Exception e) {
-            e.printStackTrace();
-        }
-    }
-
     @Override
     public void surfaceChanged(SurfaceHolder holder, int format, int width, int height)
     {
@@ -143,5 +144,9 @@ public class MainActivity extends Activity implements SurfaceHolder.Callback
     public void onPause()
     {
         super.onPause();
+
+        // no reason to keep generating for a screen nobody looks at
+        if (stream != 0)
+            gpt2.cancelStream(stream);
     }
 }
@@ -13,289 +13,90 @@
 // specific language governing permissions and limitations under the License.
 
 #include "gpt2.h"
-#include <map>
-#include <fstream>
-#include <string>
-#include <cstdlib>
-#include <wchar.h>
-#include <iostream>
-#include <codecvt>
-#include <ctime>
-#include <algorithm>
-#include <functional>
-#include <numeric>
-#include <time.h>
 
-#include "cpu.h"
+#include <android/log.h>
 
-#define LOGI(...) __android_log_print(ANDROID_LOG_INFO , "GPT2", __VA_ARGS__)
-
-int __Neg_Infinity = 0xFF800000;
-const float Neg_Infinity = *((float*)&__Neg_Infinity);
-
-class DivTrilWhere : public ncnn::Layer
-{
-public:
-    DivTrilWhere()
-    {
-        one_blob_only = true;
-    }
-
-    virtual int forward(const ncnn::Mat& bottom_blob, ncnn::Mat& top_blob, const ncnn::Option& opt) const
-    {
-        int w = bottom_blob.w;
-        int h = bottom_blob.h;
-        int channels = bottom_blob.c;
-
-        top_blob.create(w, h, channels, 4u, 1, opt.blob_allocator);
-        if (top_blob.empty())
-            return -100;
-
-#pragma omp parallel for num_threads(opt.num_threads)
-        for (int p = 0; p < channels; p++)
-        {
-            const float* src = bottom_blob.channel(p);
-            float* dst = top_blob.channel(p);
-            for (int y = 0; y < h; y++) {
-                for (int x = 0; x < w; x++) {
-                    if (x > y) {
-                        dst[0] = -1e4f;
-                    }
-                    else {
-                        dst[0] = src[0] / 8.0f;
-                    }
-                    src++;
-                    dst++;
-                }
-            }
-        }
-
-        return 0;
-    }
-};
-
-DEFINE_LAYER_CREATOR(DivTrilWhere)
-
-class Gather : public ncnn::Layer
-{
-public:
-    Gather()
-    {
-        one_blob_only = false;
-    }
-
-    virtual int forward(const std::vector<ncnn::Mat>& bottom_blobs, std::vector<ncnn::Mat>& top_blobs, const ncnn::Option& opt) const
-    {
-        int w = bottom_blobs[1].w;
-        int vocab_size = bottom_blobs[0].h;
-        int n_embd = bottom_blobs[0].w;
-
-        ncnn::Mat& top_blob = top_blobs[0];
-        top_blob.create(n_embd, w, 4u, 1, opt.blob_allocator);
-        if (top_blob.empty())
-            return -100;
-
-        float* dst = top_blob;
-        const float* in = bottom_blobs[1];
-        const float* weight = bottom_blobs[0];
-
-#pragma omp parallel for num_threads(opt.num_threads)
-        for (int c = 0; c < w; c++) {
-            int idx = std::round(*in) * n_embd;
-            memcpy(dst, weight + idx, n_embd * 4);
-            in++;
-            dst += n_embd;
-        }
-
-        return 0;
-    }
-};
-
-DEFINE_LAYER_CREATOR(Gather)
-
-std::string WStringToString(const std::wstring& wstr)
-{
-    using convert_typeX = std::codecvt_utf8<wchar_t>;
-    std::wstring_convert<convert_typeX, wchar_t> converterX;
-    return converterX.to_bytes(wstr);
-}
+#include <vector>
 
-std::wstring StringToWString(const std::string& str)
-{
-    using convert_typeX = std::codecvt_utf8<wchar_t>;
-    std::wstring_convert<convert_typeX, wchar_t> converterX;
-    return converterX.from_bytes(str);
-}
-
-std::vector<int> vector_merge(std::vector<int> v1, std::vector<int> v2)
-{
-    std::vector<int> v3;
-    v3.insert(v3.end(), v1.begin(), v1.end());
-    v3.insert(v3.end(), v2.begin(), v2.end());
-    return v3;
-}
+#include "threadpool.h"
 
-void top_k_filtering(ncnn::Mat& logits)
-{
-    ncnn::Mat filtered_logits;
-    filtered_logits.clone_from(logits);
-    float* pt = filtered_logits;
-    std::sort(pt, pt + 13317, std::greater<float>());
-    float top_k_value = pt[8 - 1]; // topk的阈值
-    for (int i = 0; i < 13317; i++) {
-        if (logits[i] < top_k_value)
-            logits[i] = Neg_Infinity;
-    }
-}
+#define LOGI(...) __android_log_print(ANDROID_LOG_INFO , "GPT2", __VA_ARGS__)
 
-template<typename _Tp>
-int softmax(const _Tp* src, _Tp* dst, int length)
+GPT2::GPT2()
 {
-    const _Tp alpha = *std::max_element(src, src + length);
-    _Tp denominator{ 0 };
-
-    for (int i = 0; i < length; ++i) {
-        dst[i] = std::exp(src[i] - alpha);
-        denominator += dst[i];
-    }
-
-    for (int i = 0; i < length; ++i) {
-        dst[i] /= denominator;
-    }
-
-    return 0;
+    engine = 0;
+    session = 0;
 }
 
-int multinomial(const ncnn::Mat& logits)
+GPT2::~GPT2()
 {
-    ncnn::Mat weight;
-    weight.clone_from(logits);
-    for (int i = 1; i < 13317; i++)
-        weight[i] += weight[i - 1];
-    std::srand(static_cast <unsigned> (time(NULL)));
-    float r = static_cast<float>(rand() % 13317) / 13317.0f;
-    float* pt = weight;
-    return std::lower_bound(pt, pt + 13317, r) - pt;
+    release();
 }
 
-GPT2::GPT2()
+void GPT2::release()
 {
-    blob_pool_allocator.set_size_compare_ratio(0.f);
-    workspace_pool_allocator.set_size_compare_ratio(0.f);
+    gpt2_session_destroy(session);
+    session = 0;
+    gpt2_engine_destroy(engine);
+    engine = 0;
 }
 
-int GPT2::load(AAssetManager* mgr, std::string vocab)
+int GPT2::load(AAssetManager* mgr, const char* cachedir)
 {
-    net.clear();
-    blob_pool_allocator.clear();
-    workspace_pool_allocator.clear();
+    release();
 
-    ncnn::set_cpu_powersave(2);
-    ncnn::set_omp_num_threads(ncnn::get_big_cpu_count());
+    engine = gpt2_engine_create();
 
-    net.opt = ncnn::Option();
-#if NCNN_VULKAN
-    net.opt.use_vulkan_compute = 0;
-#endif
-    net.opt.lightmode = true;
-    net.opt.use_packing_layout = false;
-    net.opt.num_threads = ncnn::get_big_cpu_count();
-    net.opt.blob_allocator = &blob_pool_allocator;
-    net.opt.workspace_allocator = &workspace_pool_allocator;
+    // the gemm weights in panels for this cpu, packed on the first start and mapped from the cache dir afterwards
+    std::string cachepath = std::string(cachedir) + "/gpt2.prepack";
+    gpt2_engine_set_prepack_path(engine, cachepath.c_str());
 
-    net.register_custom_layer("DivTrilWhere", DivTrilWhere_layer_creator);
-    net.register_custom_layer("Gather", Gather_layer_creator);
-    net.load_param(mgr, "gpt2.param");
-    net.load_model(mgr, "gpt2.bin");
+    // fp16 keys and values, half the memory and bandwidth of attention
+    gpt2_engine_set_kv_cache(engine, GPT2_KV_FP16, 0);
 
-    LOGI("load ncnn model ok!");
+    // the model runs on the big cores only, one pinned thread each
+    std::vector<int> big_cpus = get_cpu_list(2);
+    gpt2_engine_set_cpus(engine, big_cpus.data(), (int)big_cpus.size());
 
-
-    std::ifstream infile;
-    infile.open(vocab.data());
-    std::string s;
-    int idx = 0;
-    while (getline(infile, s)) {
-        auto ws = StringToWString(s);
-        tokenizer_token2idx.insert(std::pair<std::wstring, int>(ws, idx));
-        tokenizer_idx2token.insert(std::pair<int, std::wstring>(idx, ws));
-        idx++;
+    // gpt2.pack from the apk, or the param, the weights and the vocab as separate assets
+    if (gpt2_engine_load_asset(engine, mgr) != 0)
+    {
+        release();
+        return -1;
     }
-    infile.close();
 
-    LOGI("load vocab: %d\n", idx);
+    LOGI("load gpt2 ok, vocab: %d\n", gpt2_engine_vocab_size(engine));
 
+    session = gpt2_session_create(engine);
+    gpt2_session_set_max_history_len(session, 3);
+    gpt2_session_set_max_len(session, 25);
 
     return 0;
 }
 
-std::vector<int> GPT2::token2idx(std::string token)
+static void on_piece(const char* text, size_t size, void* userdata)
 {
-    std::vector<int> idx;
-    std::wstring wtoken = StringToWString(token);
-    for(int i = 0; i < wtoken.length(); i++) {
-        std::wstring tmp = wtoken.substr(i,1);
-        idx.push_back(tokenizer_token2idx[tmp]);
-    }
-    return idx;
+    (*(const std::function<void(std::string_view)>*)userdata)(std::string_view(text, size));
 }
 
-std::string GPT2::idx2token(std::vector<int> idx)
+std::string GPT2::chat(std::string in, const std::function<void(std::string_view)>& on_text)
 {
-    std::wstring wtoken;
-    for(int i = 0; i < idx.size(); i++){
-        wtoken += tokenizer_idx2token[idx[i]];
-    }
-    std::string token = WStringToString(wtoken);
-    return token;
-}
+    if (!session)
+        return std::string();
 
-std::string GPT2::chat(std::string in)
-{
-    std::vector<int> text_ids = token2idx(in);
-    history.push_back(text_ids);
-    std::vector<int> input_ids = { 101 };
-    int history_len = 3;
-    if (history.size() < max_history_len)
-        history_len = history.size();
-    std::vector<std::vector<int>> max_history;
-    max_history.assign(history.end() - history_len, history.end());
-    for (std::vector<int> history_utr : max_history) {
-        input_ids = vector_merge(input_ids, history_utr);
-        input_ids.push_back(102);
-    }
-
-    std::vector<int> response;
-    for (int it = 0; it < max_len; it++) {
+    if (gpt2_session_chat(session, in.c_str(), on_text ? on_piece : 0, (void*)&on_text) < 0)
+        return std::string();
 
-        ncnn::Mat input_ids_mat(input_ids.size());
-        ncnn::Mat position_ids_mat(input_ids.size());
-        for (int i = 0; i < input_ids.size(); i++) {
-            input_ids_mat[i] = float(input_ids[i]);
-            position_ids_mat[i] = float(i);
-        }
-
-        ncnn::Mat logits;
-        {
-            ncnn::Extractor ex = net.create_extractor();
-            ex.input("0", input_ids_mat);
-            ex.input("input.3", position_ids_mat);
-            ex.extract("1673", logits);
-        }
+    return gpt2_session_reply(session);
+}
 
-        ncnn::Mat next_token_logits;
-        next_token_logits.clone_from(logits.row_range(logits.h - 1, 1));
-        next_token_logits[100] = Neg_Infinity;
-        top_k_filtering(next_token_logits);
-        softmax<float>(next_token_logits, next_token_logits, 13317);
-        int next_token = multinomial(next_token_logits);
-        if (next_token == 102) break;
-        response.push_back(next_token);
-        input_ids.push_back(next_token);
-    }
+gpt2_stream_t GPT2::chat_async(std::string in, int timeout_ms)
+{
+    if (!session)
+        return 0;
 
-    history.push_back(response);
-    std::string bot_text = idx2token(response);
+    // one conversation, the previous turn is abandoned
+    gpt2_session_cancel(session);
 
-    return bot_text;
+    return gpt2_session_submit(session, in.c_str(), 0, 0, timeout_ms);
 }
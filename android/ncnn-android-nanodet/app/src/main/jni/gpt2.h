@@ -15,34 +15,37 @@
 #ifndef GPT2_H
 #define GPT2_H
 
-#include <map>
-#include <net.h>
-#include <vector>
+#include <android/asset_manager.h>
+
+#include <functional>
+#include <string>
+#include <string_view>
+
+#include "gpt2_api.h"
 
 class GPT2
 {
 public:
     GPT2();
+    ~GPT2();
 
-    int load(AAssetManager* mgr, std::string vocab);
-    std::string chat(std::string in);
+    // cachedir is writable app storage for the prepacked weights
+    int load(AAssetManager* mgr, const char* cachedir);
+    // on_text, if set, gets each piece of the reply as soon as its token is sampled
+    std::string chat(std::string in, const std::function<void(std::string_view)>& on_text = nullptr);
+    // return at once, the reply is generated on the scheduler thread and read from the stream
+    // a new turn cancels the one still running, timeout_ms 0 for no deadline
+    // the caller destroys the stream
+    gpt2_stream_t chat_async(std::string in, int timeout_ms = 0);
 
 private:
-    std::vector<int> token2idx(std::string token);
-    std::string idx2token(std::vector<int> idx);
+    void release();
 
 private:
-    ncnn::Net net;
-    ncnn::UnlockedPoolAllocator blob_pool_allocator;
-    ncnn::PoolAllocator workspace_pool_allocator;
-
-    std::map<std::wstring, int> tokenizer_token2idx;
-    std::map<int, std::wstring> tokenizer_idx2token;
-
-    const int max_history_len = 3;
-    const int max_len = 25;
-
-    std::vector<std::vector<int>> history;
+    // model, tokenizer, kv pool and scheduler of the core library
+    gpt2_engine_t engine;
+    // the conversation of this app
+    gpt2_session_t session;
 };
 
 #endif // NANODET_H
@@ -20,17 +20,16 @@
 
 #include <jni.h>
 
+#include <memory>
+#include <stdint.h>
 #include <string>
 #include <vector>
-#include <locale>
-#include <codecvt>
-#include <fstream>
-#include <map>
 
 #include <platform.h>
 #include <benchmark.h>
 
 #include "gpt2.h"
+#include "utf8.h"
 
 #define LOGI(...) __android_log_print(ANDROID_LOG_INFO , "read txt", __VA_ARGS__)
 
@@ -41,12 +40,6 @@
 static GPT2* g_nanodet = 0;
 static ncnn::Mutex lock;
 
-static std::string UTF16StringToUTF8String(const char16_t* chars, size_t len) {
-    std::u16string u16_string(chars, len);
-    return std::wstring_convert<std::codecvt_utf8_utf16<char16_t>, char16_t>{}
-            .to_bytes(u16_string);
-}
-
 std::string JavaStringToString(JNIEnv* env, jstring str) {
     if (env == nullptr || str == nullptr) {
         return "";
@@ -55,19 +48,14 @@ std::string JavaStringToString(JNIEnv* env, jstring str) {
     if (chars == nullptr) {
         return "";
     }
-    std::string u8_string = UTF16StringToUTF8String(
-            reinterpret_cast<const char16_t*>(chars), env->GetStringLength(str));
+    std::string u8_string = utf16_to_utf8(std::u16string_view(
+            reinterpret_cast<const char16_t*>(chars), env->GetStringLength(str)));
     env->ReleaseStringChars(str, chars);
     return u8_string;
 }
 
-static std::u16string UTF8StringToUTF16String(const std::string& string) {
-    return std::wstring_convert<std::codecvt_utf8_utf16<char16_t>, char16_t>{}
-            .from_bytes(string);
-}
-
 jstring StringToJavaString(JNIEnv* env, const std::string& u8_string) {
-    std::u16string u16_string = UTF8StringToUTF16String(u8_string);
+    std::u16string u16_string = utf8_to_utf16(u8_string);
     auto result =env->NewString(reinterpret_cast<const jchar*>(u16_string.data()),
                                 u16_string.length());
     return result;
@@ -75,20 +63,19 @@ jstring StringToJavaString(JNIEnv* env, const std::string& u8_string) {
 
 extern "C" {
 
-JNIEXPORT jboolean JNICALL Java_com_edvince_gpt2chatbot_GPT2_loadGPT2(JNIEnv* env, jobject thiz, jobject assetManager, jstring jvocab)
+JNIEXPORT jboolean JNICALL Java_com_edvince_gpt2chatbot_GPT2_loadGPT2(JNIEnv* env, jobject thiz, jobject assetManager, jstring cacheDir)
 {
     AAssetManager* mgr = AAssetManager_fromJava(env, assetManager);
-    std::string vocab = JavaStringToString(env,jvocab);
+    std::string cachedir = JavaStringToString(env, cacheDir);
 
     {
         ncnn::MutexLockGuard g(lock);
         if (!g_nanodet)
             g_nanodet = new GPT2;
-        g_nanodet->load(mgr,vocab);
+        if (g_nanodet->load(mgr, cachedir.c_str()) != 0)
+            return JNI_FALSE;
     }
 
-
-
     return JNI_TRUE;
 }
 
@@ -96,11 +83,56 @@ JNIEXPORT jstring JNICALL Java_com_edvince_gpt2chatbot_GPT2_chat(JNIEnv* env, jo
 {
     std::string cpp_in = JavaStringToString(env, in);
 
-    std::string cpp_out = g_nanodet->chat(cpp_in);
+    std::string cpp_out;
+    {
+        ncnn::MutexLockGuard g(lock);
+        if (g_nanodet)
+            cpp_out = g_nanodet->chat(cpp_in);
+    }
 
     jstring java_out = StringToJavaString(env,cpp_out);
 
     return java_out;
 }
 
+// the handle is a gpt2_stream_t of the c api until releaseStream
+JNIEXPORT jlong JNICALL Java_com_edvince_gpt2chatbot_GPT2_chatAsync(JNIEnv* env, jobject thiz, jstring in, jint timeoutMs)
+{
+    std::string cpp_in = JavaStringToString(env, in);
+
+    gpt2_stream_t stream = 0;
+    {
+        ncnn::MutexLockGuard g(lock);
+        if (g_nanodet)
+            stream = g_nanodet->chat_async(cpp_in, timeoutMs);
+    }
+
+    return (jlong)(intptr_t)stream;
+}
+
+// the text generated since the last call, "" if none came within timeoutMs, null once the reply is complete
+JNIEXPORT jstring JNICALL Java_com_edvince_gpt2chatbot_GPT2_readStream(JNIEnv* env, jobject thiz, jlong handle, jint timeoutMs)
+{
+    if (!handle)
+        return NULL;
+
+    const char* text = 0;
+    size_t size = 0;
+    if (gpt2_stream_read((gpt2_stream_t)(intptr_t)handle, timeoutMs, &text, &size) < 0)
+        return NULL;
+
+    return StringToJavaString(env, std::string(text, size));
+}
+
+JNIEXPORT void JNICALL Java_com_edvince_gpt2chatbot_GPT2_cancelStream(JNIEnv* env, jobject thiz, jlong handle)
+{
+    if (handle)
+        gpt2_stream_cancel((gpt2_stream_t)(intptr_t)handle);
+}
+
+JNIEXPORT void JNICALL Java_com_edvince_gpt2chatbot_GPT2_releaseStream(JNIEnv* env, jobject thiz, jlong handle)
+{
+    gpt2_stream_destroy((gpt2_stream_t)(intptr_t)handle);
+}
+
 }
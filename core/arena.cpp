@@ -0,0 +1,116 @@
+#include "arena.h"
+
+#include <algorithm>
+#include <stdlib.h>
+
+#ifdef _WIN32
+#include <malloc.h>
+#endif
+
+static unsigned char* aligned_malloc(size_t size)
+{
+#ifdef _WIN32
+    return (unsigned char*)_aligned_malloc(size, 64);
+#else
+    void* ptr = 0;
+    if (posix_memalign(&ptr, 64, size) != 0)
+        return 0;
+    return (unsigned char*)ptr;
+#endif
+}
+
+static void aligned_free(unsigned char* ptr)
+{
+#ifdef _WIN32
+    _aligned_free(ptr);
+#else
+    free(ptr);
+#endif
+}
+
+Arena::Arena()
+{
+    data = 0;
+    cap = 0;
+    used = 0;
+    peak = 0;
+}
+
+Arena::~Arena()
+{
+    aligned_free(data);
+}
+
+int Arena::reserve(size_t size)
+{
+    used = 0;
+    if (size <= cap)
+        return 0;
+
+    aligned_free(data);
+    cap = 0;
+
+    data = aligned_malloc(aligned(size));
+    if (!data)
+        return -100;
+
+    cap = aligned(size);
+    return 0;
+}
+
+void* Arena::alloc(size_t size)
+{
+    size = aligned(size);
+    if (size > cap - used)
+        return 0;
+
+    void* ptr = data + used;
+    used += size;
+    if (used > peak)
+        peak = used;
+    return ptr;
+}
+
+size_t plan_slab(SlabBuffer* buffers, int count)
+{
+    // placement order by size, a handful of buffers, insertion sort keeps it stable without a heap buffer
+    int order[32];
+    count = std::min(count, 32);
+    for (int i = 0; i < count; i++)
+    {
+        int j = i;
+        for (; j > 0 && buffers[order[j - 1]].bytes < buffers[i].bytes; j--)
+            order[j] = order[j - 1];
+        order[j] = i;
+    }
+
+    size_t total = 0;
+    for (int i = 0; i < count; i++)
+    {
+        SlabBuffer& buffer = buffers[order[i]];
+        const size_t bytes = Arena::aligned(buffer.bytes);
+
+        // bump past every placed buffer that is live at the same time and in the way, until a gap fits
+        size_t offset = 0;
+        for (bool moved = true; moved;)
+        {
+            moved = false;
+            for (int j = 0; j < i; j++)
+            {
+                const SlabBuffer& other = buffers[order[j]];
+                if (other.last < buffer.first || buffer.last < other.first)
+                    continue;
+                const size_t other_end = other.offset + Arena::aligned(other.bytes);
+                if (offset < other_end && other.offset < offset + bytes)
+                {
+                    offset = other_end;
+                    moved = true;
+                }
+            }
+        }
+
+        buffer.offset = offset;
+        total = std::max(total, offset + bytes);
+    }
+    return total;
+}
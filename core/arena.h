@@ -0,0 +1,64 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+// bump allocator over one aligned block
+// the scratch of a forward is carved out front to back and dropped all at once by reset(),
+// so a forward that fits the block does not touch the heap
+class Arena
+{
+public:
+    Arena();
+    ~Arena();
+
+    // at least size bytes, a larger block drops everything handed out so far
+    // -100 if the block cannot be allocated
+    int reserve(size_t size);
+
+    // size bytes aligned to 64, null once the block is used up
+    void* alloc(size_t size);
+    template<typename T>
+    T* alloc_array(size_t count)
+    {
+        return (T*)alloc(count * sizeof(T));
+    }
+
+    void reset() { used = 0; }
+
+    size_t capacity() const { return cap; }
+    size_t used_bytes() const { return used; }
+    // the most that was ever in use at once
+    size_t peak_bytes() const { return peak; }
+
+    // bytes taken by alloc(size), the padding included
+    static size_t aligned(size_t size) { return (size + 63) & ~(size_t)63; }
+
+private:
+    Arena(const Arena&);
+    Arena& operator=(const Arena&);
+
+private:
+    unsigned char* data;
+    size_t cap;
+    size_t used;
+    size_t peak;
+};
+
+// a scratch buffer and the first and last phase of a forward it is used in
+struct SlabBuffer
+{
+    const char* name;
+    size_t bytes;
+    int first;
+    int last;
+    // set by plan_slab, 64 byte aligned
+    size_t offset;
+};
+
+// liveness planning, place the buffers in one slab so that two of them only overlap in memory when
+// no phase uses both, largest first, each at the lowest offset clear of the placed ones it meets
+// return the slab size
+size_t plan_slab(SlabBuffer* buffers, int count);
+
+#endif // ARENA_H
@@ -0,0 +1,74 @@
+#include "detokenizer.h"
+
+#include "tokenizer.h"
+#include "utf8.h"
+
+static bool is_word_char(unsigned int c)
+{
+    if ((c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z'))
+        return true;
+
+    // latin-1 supplement and latin extended-a/b letters
+    return c >= 0xc0 && c <= 0x24f && c != 0xd7 && c != 0xf7;
+}
+
+// [CLS] [SEP] [unused1] ..., a lone [ or ] is punctuation
+static bool is_special(std::string_view token)
+{
+    if (token.size() < 3 || token.front() != '[' || token.back() != ']')
+        return false;
+
+    for (size_t i = 1; i + 1 < token.size(); i++)
+    {
+        char c = token[i];
+        if (!((c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z')))
+            return false;
+    }
+    return true;
+}
+
+Detokenizer::Detokenizer(const Tokenizer& _tokenizer)
+    : tokenizer(_tokenizer)
+{
+    after_word = false;
+    after_punct = false;
+    fragment.reserve(64);
+}
+
+void Detokenizer::reset()
+{
+    after_word = false;
+    after_punct = false;
+}
+
+std::string_view Detokenizer::push(int id)
+{
+    fragment.clear();
+
+    std::string_view token = tokenizer.id_to_token(id);
+    if (token.empty() || is_special(token))
+        return std::string_view();
+
+    bool continuation = token.size() > 2 && token[0] == '#' && token[1] == '#';
+    if (continuation)
+        token.remove_prefix(2);
+
+    size_t pos = 0;
+    unsigned int first = utf8_decode(token, pos);
+
+    // "a b", "a. b" but "3.14" and "i'm"
+    bool is_letter = is_word_char(first) && !(first >= '0' && first <= '9');
+    if (!continuation && ((after_word && is_word_char(first)) || (after_punct && is_letter)))
+        fragment += ' ';
+    fragment += token;
+
+    // last code point of the piece
+    size_t last = token.size() - 1;
+    while (last > 0 && ((unsigned char)token[last] & 0xc0) == 0x80)
+        last--;
+    unsigned int c = utf8_decode(token, last);
+    after_word = is_word_char(c);
+    after_punct = c == '.' || c == ',' || c == '!' || c == '?' || c == ';' || c == ':';
+
+    return fragment;
+}
@@ -0,0 +1,35 @@
+#ifndef DETOKENIZER_H
+#define DETOKENIZER_H
+
+#include <string>
+#include <string_view>
+
+class Tokenizer;
+
+// incremental id -> text for one reply, text is available as soon as each token is sampled
+// ##pieces glue to the previous piece, consecutive latin words get a space and so do
+// words after ascii sentence punctuation, cjk and other punctuation are joined as is, [CLS] [SEP] [PAD] and friends are dropped
+class Detokenizer
+{
+public:
+    explicit Detokenizer(const Tokenizer& tokenizer);
+
+    // start a new reply
+    void reset();
+
+    // the utf-8 text that token id adds to the reply, possibly empty
+    // every fragment is complete utf-8 on its own, the view stays valid until the next push
+    std::string_view push(int id);
+
+private:
+    const Tokenizer& tokenizer;
+
+    // the last emitted char was a latin letter or digit
+    bool after_word;
+    // the last emitted char was one of .,!?;:
+    bool after_punct;
+
+    std::string fragment;
+};
+
+#endif // DETOKENIZER_H
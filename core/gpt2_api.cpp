@@ -0,0 +1,510 @@
+#include "gpt2_api.h"
+
+#include <mutex>
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+#include "kvcache.h"
+#include "model.h"
+#include "package.h"
+#include "prefixcache.h"
+#include "scheduler.h"
+#include "session.h"
+#include "threadpool.h"
+#include "tokenizer.h"
+
+struct __gpt2_engine_t
+{
+    // options of the next load
+    int num_threads;
+    std::vector<int> cpus;
+    std::string prepack_path;
+    size_t memory_budget;
+    int placement;
+    int kv_type;
+    int kv_max_blocks;
+    int prefix_blocks;
+    int max_batch;
+    int max_batch_tokens;
+
+    // the package backs model and tokenizer when there is one
+    Package package;
+    Model model;
+    Tokenizer tokenizer;
+    KVPool kvpool;
+    PrefixCache* prefix_cache;
+
+    // one per numa node with replicas, and the sessions placed on each
+    std::vector<Scheduler*> schedulers;
+    std::vector<int> session_counts;
+    std::mutex lock;
+    bool loaded;
+};
+
+struct __gpt2_session_t
+{
+    gpt2_engine_t engine;
+    int scheduler;
+    Session* session;
+    // the turns submitted and not over yet, in order, the last one runs after all the others
+    std::vector<std::shared_ptr<Stream> > streams;
+    // of the last gpt2_session_chat
+    std::string reply;
+    int reply_tokens;
+};
+
+struct __gpt2_stream_t
+{
+    std::shared_ptr<Stream> stream;
+    std::string text;
+    std::string reply;
+};
+
+static std::function<void(std::string_view)> text_callback(gpt2_text_callback on_text, void* userdata)
+{
+    if (!on_text)
+        return nullptr;
+
+    return [on_text, userdata](std::string_view piece) { on_text(piece.data(), piece.size(), userdata); };
+}
+
+// a turn was queued on the scheduler, the finished ones are forgotten
+static void track_stream(gpt2_session_t session, const std::shared_ptr<Stream>& stream)
+{
+    size_t j = 0;
+    for (size_t i = 0; i < session->streams.size(); i++)
+    {
+        if (session->streams[i]->status() == STREAM_RUNNING)
+            session->streams[j++] = session->streams[i];
+    }
+    session->streams.resize(j);
+    session->streams.push_back(stream);
+}
+
+// undo start_engine, a failed load can be retried
+static void stop_engine(gpt2_engine_t engine)
+{
+    for (size_t i = 0; i < engine->schedulers.size(); i++)
+        delete engine->schedulers[i];
+    engine->schedulers.clear();
+    engine->session_counts.clear();
+
+    delete engine->prefix_cache;
+    engine->prefix_cache = 0;
+
+    // a retried load reopens the file the loaders read from
+    engine->model.stop_streaming();
+}
+
+// everything after the model and tokenizer are in
+static int start_engine(gpt2_engine_t engine)
+{
+    Model& model = engine->model;
+
+    // a failed prepack or placement leaves the weights where they were loaded, which is slower but correct
+    if (!engine->prepack_path.empty())
+        model.prepack(engine->prepack_path.c_str());
+    if (engine->memory_budget)
+        model.set_memory_budget(engine->memory_budget);
+    if (engine->placement)
+        model.place(engine->placement);
+
+    // the blocks page in on background threads, the first reply only waits for the ones it reaches
+    if (model.stream(4) != 0)
+        return -1;
+
+    if (engine->kvpool.create(model.config(), 16, engine->kv_max_blocks, engine->kv_type) != 0)
+    {
+        stop_engine(engine);
+        return -1;
+    }
+    if (engine->prefix_blocks > 0)
+        engine->prefix_cache = new PrefixCache(&engine->kvpool, engine->prefix_blocks);
+
+    // with replicas every node runs a scheduler of its own on its cpus, reading its local copy
+    std::vector<std::vector<int> > nodes;
+    if (engine->placement & GPT2_PLACE_NUMA_REPLICAS)
+        nodes = get_numa_nodes();
+    else
+        nodes.push_back(engine->cpus);
+
+    for (size_t i = 0; i < nodes.size(); i++)
+    {
+        Scheduler* scheduler = new Scheduler(model);
+        if (engine->max_batch > 0)
+            scheduler->max_batch = engine->max_batch;
+        if (engine->max_batch_tokens > 0)
+            scheduler->max_batch_tokens = engine->max_batch_tokens;
+        if (engine->num_threads > 0)
+            scheduler->num_threads = engine->num_threads;
+        else if (!nodes[i].empty())
+            scheduler->num_threads = (int)nodes[i].size();
+        scheduler->cpus = nodes[i];
+        scheduler->prefix_cache = engine->prefix_cache;
+        if (nodes.size() > 1)
+            scheduler->numa_node = (int)i;
+
+        engine->schedulers.push_back(scheduler);
+        engine->session_counts.push_back(0);
+    }
+
+    // decode saturates memory bandwidth on a few cores, measure how many are worth waking per step
+    {
+        const Scheduler* scheduler = engine->schedulers[0];
+        ThreadPool threads;
+        threads.create(scheduler->num_threads, scheduler->cpus);
+        threads.numa_node = scheduler->numa_node;
+        model.calibrate(threads, scheduler->max_batch_tokens);
+    }
+
+    for (size_t i = 0; i < engine->schedulers.size(); i++)
+    {
+        if (engine->schedulers[i]->start() != 0)
+        {
+            stop_engine(engine);
+            return -1;
+        }
+    }
+
+    engine->loaded = true;
+    return 0;
+}
+
+extern "C" {
+
+int gpt2_api_version(void)
+{
+    return GPT2_C_API_VERSION;
+}
+
+gpt2_engine_t gpt2_engine_create(void)
+{
+    gpt2_engine_t engine = new __gpt2_engine_t;
+    engine->num_threads = 0;
+    engine->memory_budget = 0;
+    engine->placement = 0;
+    engine->kv_type = GPT2_KV_FP32;
+    engine->kv_max_blocks = 0;
+    engine->prefix_blocks = 0;
+    engine->max_batch = 0;
+    engine->max_batch_tokens = 0;
+    engine->prefix_cache = 0;
+    engine->loaded = false;
+    return engine;
+}
+
+void gpt2_engine_destroy(gpt2_engine_t engine)
+{
+    if (!engine)
+        return;
+
+    stop_engine(engine);
+    delete engine;
+}
+
+void gpt2_engine_set_num_threads(gpt2_engine_t engine, int num_threads)
+{
+    engine->num_threads = num_threads;
+}
+
+void gpt2_engine_set_cpus(gpt2_engine_t engine, const int* cpus, int count)
+{
+    engine->cpus.assign(cpus, cpus ? cpus + count : cpus);
+}
+
+void gpt2_engine_set_prepack_path(gpt2_engine_t engine, const char* path)
+{
+    engine->prepack_path = path ? path : "";
+}
+
+void gpt2_engine_set_memory_budget(gpt2_engine_t engine, size_t bytes)
+{
+    engine->memory_budget = bytes;
+}
+
+void gpt2_engine_set_placement(gpt2_engine_t engine, int flags)
+{
+    engine->placement = flags;
+}
+
+void gpt2_engine_set_kv_cache(gpt2_engine_t engine, int type, int max_blocks)
+{
+    engine->kv_type = type;
+    engine->kv_max_blocks = max_blocks;
+}
+
+void gpt2_engine_set_prefix_cache(gpt2_engine_t engine, int max_blocks)
+{
+    engine->prefix_blocks = max_blocks;
+}
+
+void gpt2_engine_set_batch(gpt2_engine_t engine, int max_batch, int max_batch_tokens)
+{
+    engine->max_batch = max_batch;
+    engine->max_batch_tokens = max_batch_tokens;
+}
+
+int gpt2_engine_load(gpt2_engine_t engine, const char* dir)
+{
+    if (engine->loaded)
+    {
+        fprintf(stderr, "gpt2 engine already loaded\n");
+        return -1;
+    }
+
+    const std::string prefix = std::string(dir) + "/";
+
+    // gpt2.pack holds the param, the weights and the compiled vocab in one file
+    FILE* fp = fopen((prefix + "gpt2.pack").c_str(), "rb");
+    if (fp)
+    {
+        fclose(fp);
+        return gpt2_engine_load_package(engine, (prefix + "gpt2.pack").c_str());
+    }
+
+    // vocab.bin is mapped as it is, vocab.txt gets compiled on the fly
+    if (engine->tokenizer.load((prefix + "vocab.bin").c_str()) != 0 && engine->tokenizer.load((prefix + "vocab.txt").c_str()) != 0)
+        return -1;
+    if (engine->model.load((prefix + "gpt2.param").c_str(), (prefix + "gpt2.bin").c_str()) != 0)
+        return -1;
+
+    return start_engine(engine);
+}
+
+int gpt2_engine_load_package(gpt2_engine_t engine, const char* path)
+{
+    if (engine->loaded)
+    {
+        fprintf(stderr, "gpt2 engine already loaded\n");
+        return -1;
+    }
+
+    if (engine->package.open(path) != 0)
+        return -1;
+
+    size_t vocab_size = 0;
+    const unsigned char* vocab = engine->package.section(SECTION_TOKENIZER, &vocab_size);
+    if (!vocab || engine->tokenizer.load(vocab, vocab_size) != 0)
+        return -1;
+    if (engine->model.load(engine->package) != 0)
+        return -1;
+
+    return start_engine(engine);
+}
+
+#if __ANDROID_API__ >= 9
+int gpt2_engine_load_asset(gpt2_engine_t engine, AAssetManager* mgr)
+{
+    if (engine->loaded)
+    {
+        fprintf(stderr, "gpt2 engine already loaded\n");
+        return -1;
+    }
+
+    if (engine->package.open(mgr, "gpt2.pack") == 0)
+    {
+        size_t vocab_size = 0;
+        const unsigned char* vocab = engine->package.section(SECTION_TOKENIZER, &vocab_size);
+        if (!vocab || engine->tokenizer.load(vocab, vocab_size) != 0)
+            return -1;
+        if (engine->model.load(engine->package) != 0)
+            return -1;
+    }
+    else
+    {
+        if (engine->model.load(mgr, "gpt2.param", "gpt2.bin") != 0)
+            return -1;
+        if (engine->tokenizer.load(mgr, "vocab.bin") != 0 && engine->tokenizer.load(mgr, "vocab.txt") != 0)
+            return -1;
+    }
+
+    return start_engine(engine);
+}
+#endif
+
+int gpt2_engine_vocab_size(gpt2_engine_t engine)
+{
+    return engine->tokenizer.vocab_size();
+}
+
+int gpt2_engine_scheduler_count(gpt2_engine_t engine)
+{
+    return (int)engine->schedulers.size();
+}
+
+int gpt2_engine_paging_stats(gpt2_engine_t engine, int* resident_blocks, long long* stalls, double* stall_seconds)
+{
+    if (!engine->loaded)
+        return -1;
+
+    const PagingStats stats = engine->model.paging_stats();
+    if (resident_blocks)
+        *resident_blocks = stats.resident_blocks;
+    if (stalls)
+        *stalls = stats.stalls;
+    if (stall_seconds)
+        *stall_seconds = stats.stall_seconds;
+    return 0;
+}
+
+gpt2_session_t gpt2_session_create(gpt2_engine_t engine)
+{
+    if (!engine->loaded)
+        return 0;
+
+    gpt2_session_t session = new __gpt2_session_t;
+    session->engine = engine;
+    session->reply_tokens = 0;
+    session->session = new Session(engine->model, engine->tokenizer, &engine->kvpool, engine->prefix_cache);
+
+    std::lock_guard<std::mutex> g(engine->lock);
+    session->scheduler = 0;
+    for (int i = 1; i < (int)engine->session_counts.size(); i++)
+    {
+        if (engine->session_counts[i] < engine->session_counts[session->scheduler])
+            session->scheduler = i;
+    }
+    engine->session_counts[session->scheduler]++;
+
+    return session;
+}
+
+void gpt2_session_destroy(gpt2_session_t session)
+{
+    if (!session)
+        return;
+
+    // the scheduler owns the session until its turns are over, queued ones included
+    for (size_t i = 0; i < session->streams.size(); i++)
+        session->streams[i]->cancel();
+    for (size_t i = 0; i < session->streams.size(); i++)
+        session->streams[i]->wait();
+    delete session->session;
+
+    {
+        gpt2_engine_t engine = session->engine;
+        std::lock_guard<std::mutex> g(engine->lock);
+        engine->session_counts[session->scheduler]--;
+    }
+
+    delete session;
+}
+
+void gpt2_session_set_max_len(gpt2_session_t session, int max_len)
+{
+    session->session->max_len = max_len;
+}
+
+void gpt2_session_set_max_history_len(gpt2_session_t session, int max_history_len)
+{
+    session->session->max_history_len = max_history_len;
+}
+
+void gpt2_session_set_top_k(gpt2_session_t session, int top_k)
+{
+    session->session->top_k = top_k;
+}
+
+void gpt2_session_set_seed(gpt2_session_t session, unsigned int seed)
+{
+    session->session->set_seed(seed);
+}
+
+void gpt2_session_clear(gpt2_session_t session)
+{
+    // turns run in order, the last one is over after all the others
+    if (!session->streams.empty())
+        session->streams.back()->wait();
+    session->streams.clear();
+    session->session->clear();
+}
+
+void gpt2_session_cancel(gpt2_session_t session)
+{
+    for (size_t i = 0; i < session->streams.size(); i++)
+        session->streams[i]->cancel();
+}
+
+int gpt2_session_chat(gpt2_session_t session, const char* text, gpt2_text_callback on_text, void* userdata)
+{
+    Scheduler* scheduler = session->engine->schedulers[session->scheduler];
+    std::shared_ptr<Stream> stream = scheduler->submit(session->session, text, text_callback(on_text, userdata));
+    if (!stream)
+        return -1;
+
+    track_stream(session, stream);
+    const int status = stream->wait();
+    session->reply = stream->reply();
+    session->reply_tokens = stream->reply_tokens();
+    return status;
+}
+
+const char* gpt2_session_reply(gpt2_session_t session)
+{
+    return session->reply.c_str();
+}
+
+int gpt2_session_reply_tokens(gpt2_session_t session)
+{
+    return session->reply_tokens;
+}
+
+gpt2_stream_t gpt2_session_submit(gpt2_session_t session, const char* text, gpt2_text_callback on_text, void* userdata, int timeout_ms)
+{
+    Scheduler* scheduler = session->engine->schedulers[session->scheduler];
+    std::shared_ptr<Stream> stream = scheduler->submit(session->session, text, text_callback(on_text, userdata), nullptr, timeout_ms);
+    if (!stream)
+        return 0;
+
+    track_stream(session, stream);
+
+    gpt2_stream_t handle = new __gpt2_stream_t;
+    handle->stream = stream;
+    return handle;
+}
+
+void gpt2_stream_destroy(gpt2_stream_t stream)
+{
+    delete stream;
+}
+
+int gpt2_stream_read(gpt2_stream_t stream, int timeout_ms, const char** text, size_t* size)
+{
+    stream->text.clear();
+    const int ret = stream->stream->read(stream->text, timeout_ms);
+    if (text)
+        *text = stream->text.c_str();
+    if (size)
+        *size = stream->text.size();
+    return ret;
+}
+
+int gpt2_stream_wait(gpt2_stream_t stream)
+{
+    return stream->stream->wait();
+}
+
+int gpt2_stream_status(gpt2_stream_t stream)
+{
+    return stream->stream->status();
+}
+
+void gpt2_stream_cancel(gpt2_stream_t stream)
+{
+    stream->stream->cancel();
+}
+
+const char* gpt2_stream_reply(gpt2_stream_t stream)
+{
+    if (stream->reply.empty() && stream->stream->status() != STREAM_RUNNING)
+        stream->reply = stream->stream->reply();
+    return stream->reply.c_str();
+}
+
+int gpt2_stream_reply_tokens(gpt2_stream_t stream)
+{
+    return stream->stream->reply_tokens();
+}
+
+} // extern "C"
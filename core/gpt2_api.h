@@ -0,0 +1,160 @@
+#ifndef GPT2_API_H
+#define GPT2_API_H
+
+#include <stddef.h>
+
+#if __ANDROID_API__ >= 9
+#include <android/asset_manager.h>
+#endif
+
+// stable c interface of the core library, the same for every front end and binding
+// handles are opaque, calls return 0 on success and -1 on failure unless noted otherwise
+// errors are reported on stderr like the rest of the core
+
+#if defined(_WIN32) && defined(GPT2_SHARED_LIBRARY)
+#ifdef GPT2_BUILDING_LIBRARY
+#define GPT2_EXPORT __declspec(dllexport)
+#else
+#define GPT2_EXPORT __declspec(dllimport)
+#endif
+#elif defined(__GNUC__)
+#define GPT2_EXPORT __attribute__((visibility("default")))
+#else
+#define GPT2_EXPORT
+#endif
+
+// bumped when a declaration below changes, additions keep it
+#define GPT2_C_API_VERSION 1
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+GPT2_EXPORT int gpt2_api_version(void);
+
+// WeightPlacement
+enum
+{
+    GPT2_PLACE_HUGE_PAGES = 1,
+    GPT2_PLACE_NUMA_REPLICAS = 2
+};
+
+// KVType
+enum
+{
+    GPT2_KV_FP32 = 0,
+    GPT2_KV_FP16 = 1,
+    GPT2_KV_INT8 = 2
+};
+
+// StreamStatus
+enum
+{
+    GPT2_STREAM_RUNNING = 0,
+    GPT2_STREAM_DONE = 1,
+    GPT2_STREAM_CANCELLED = 2,
+    GPT2_STREAM_EXPIRED = 3,
+    GPT2_STREAM_FAILED = 4
+};
+
+// a piece of reply text, not null terminated, valid during the call only
+typedef void (*gpt2_text_callback)(const char* text, size_t size, void* userdata);
+
+/* engine */
+// the model, tokenizer, kv pool and the schedulers every session of the engine runs on
+typedef struct __gpt2_engine_t* gpt2_engine_t;
+
+GPT2_EXPORT gpt2_engine_t gpt2_engine_create(void);
+// destroy the sessions first, turns still queued are finished
+GPT2_EXPORT void gpt2_engine_destroy(gpt2_engine_t engine);
+
+// the options apply to the next load
+// threads of a scheduler, 0 for all cpus, or all cpus of the node with numa replicas
+GPT2_EXPORT void gpt2_engine_set_num_threads(gpt2_engine_t engine, int num_threads);
+// pin the threads of a single scheduler, thread i to cpus[i % count], null for no pinning
+GPT2_EXPORT void gpt2_engine_set_cpus(gpt2_engine_t engine, const int* cpus, int count);
+// gemm weights in panels for this cpu cached at path, see Model::prepack, null to not prepack
+GPT2_EXPORT void gpt2_engine_set_prepack_path(gpt2_engine_t engine, const char* path);
+// cap on the resident weights, see Model::set_memory_budget, 0 for no cap
+GPT2_EXPORT void gpt2_engine_set_memory_budget(gpt2_engine_t engine, size_t bytes);
+// GPT2_PLACE_* flags, see Model::place, numa replicas get one scheduler per node
+GPT2_EXPORT void gpt2_engine_set_placement(gpt2_engine_t engine, int flags);
+// GPT2_KV_* storage of the kv cache, and the kv blocks of all sessions together, 0 for no limit
+GPT2_EXPORT void gpt2_engine_set_kv_cache(gpt2_engine_t engine, int type, int max_blocks);
+// kv blocks of shared prompt prefixes kept for reuse across sessions, 0 for none
+GPT2_EXPORT void gpt2_engine_set_prefix_cache(gpt2_engine_t engine, int max_blocks);
+// sessions and tokens per batched step of a scheduler
+GPT2_EXPORT void gpt2_engine_set_batch(gpt2_engine_t engine, int max_batch, int max_batch_tokens);
+
+// gpt2.pack in dir, or gpt2.param, gpt2.bin and vocab.bin or vocab.txt
+GPT2_EXPORT int gpt2_engine_load(gpt2_engine_t engine, const char* dir);
+// a single file package written by tools/gpt2pack
+GPT2_EXPORT int gpt2_engine_load_package(gpt2_engine_t engine, const char* path);
+#if __ANDROID_API__ >= 9
+// the same files from the root of the apk assets
+GPT2_EXPORT int gpt2_engine_load_asset(gpt2_engine_t engine, AAssetManager* mgr);
+#endif
+
+GPT2_EXPORT int gpt2_engine_vocab_size(gpt2_engine_t engine);
+// schedulers the sessions are spread over, one per numa node with replicas
+GPT2_EXPORT int gpt2_engine_scheduler_count(gpt2_engine_t engine);
+// see Model::paging_stats, any pointer may be null
+GPT2_EXPORT int gpt2_engine_paging_stats(gpt2_engine_t engine, int* resident_blocks, long long* stalls, double* stall_seconds);
+
+/* session */
+// one conversation, used from one thread at a time, sessions of one engine run batched together
+typedef struct __gpt2_session_t* gpt2_session_t;
+
+// on the scheduler with the fewest sessions, null if the engine is not loaded
+GPT2_EXPORT gpt2_session_t gpt2_session_create(gpt2_engine_t engine);
+// a turn still running is cancelled and waited for
+GPT2_EXPORT void gpt2_session_destroy(gpt2_session_t session);
+
+// reply length limit in tokens
+GPT2_EXPORT void gpt2_session_set_max_len(gpt2_session_t session, int max_len);
+// utterances fed back as context, the current one included
+GPT2_EXPORT void gpt2_session_set_max_history_len(gpt2_session_t session, int max_history_len);
+// sample from the k most likely tokens
+GPT2_EXPORT void gpt2_session_set_top_k(gpt2_session_t session, int top_k);
+GPT2_EXPORT void gpt2_session_set_seed(gpt2_session_t session, unsigned int seed);
+// forget the conversation, waits for a turn still running
+GPT2_EXPORT void gpt2_session_clear(gpt2_session_t session);
+// stop the turn still running, if any, the reply so far stays in the history
+GPT2_EXPORT void gpt2_session_cancel(gpt2_session_t session);
+
+// one turn, block until the reply is complete, on_text, if set, gets each piece as soon as its token is sampled
+// return the StreamStatus of the turn, -1 if it could not be queued
+GPT2_EXPORT int gpt2_session_chat(gpt2_session_t session, const char* text, gpt2_text_callback on_text, void* userdata);
+// the reply of the last complete turn, valid until the next one
+GPT2_EXPORT const char* gpt2_session_reply(gpt2_session_t session);
+// its length in tokens
+GPT2_EXPORT int gpt2_session_reply_tokens(gpt2_session_t session);
+
+/* stream */
+// a turn running on the scheduler, readable from any thread
+typedef struct __gpt2_stream_t* gpt2_stream_t;
+
+// queue one turn and return at once, the next turn of the session waits for this one
+// on_text, if set, runs on the scheduler thread, timeout_ms 0 for no deadline
+GPT2_EXPORT gpt2_stream_t gpt2_session_submit(gpt2_session_t session, const char* text, gpt2_text_callback on_text, void* userdata, int timeout_ms);
+// the session stays usable, destroying a running stream does not stop its turn
+GPT2_EXPORT void gpt2_stream_destroy(gpt2_stream_t stream);
+
+// the text generated since the last read, valid until the next read
+// return 1 with new text, 0 if none came within timeout_ms, -1 once the turn is over and all text was read
+// timeout_ms -1 waits
+GPT2_EXPORT int gpt2_stream_read(gpt2_stream_t stream, int timeout_ms, const char** text, size_t* size);
+// block until the turn is over, return its StreamStatus
+GPT2_EXPORT int gpt2_stream_wait(gpt2_stream_t stream);
+GPT2_EXPORT int gpt2_stream_status(gpt2_stream_t stream);
+GPT2_EXPORT void gpt2_stream_cancel(gpt2_stream_t stream);
+// the whole reply once the turn is over, valid until the stream is destroyed
+GPT2_EXPORT const char* gpt2_stream_reply(gpt2_stream_t stream);
+// its length in tokens
+GPT2_EXPORT int gpt2_stream_reply_tokens(gpt2_stream_t stream);
+
+#ifdef __cplusplus
+} /* extern "C" */
+#endif
+
+#endif // GPT2_API_H
@@ -0,0 +1,332 @@
+#include "kvcache.h"
+
+#include "model.h"
+
+#include <algorithm>
+#include <atomic>
+#include <math.h>
+#include <new>
+#include <stdlib.h>
+#include <string.h>
+#include <utility>
+
+// the refcount lives in front of the block data, one cache line keeps the data aligned as malloc gave it
+static const size_t block_header_bytes = 64;
+
+static inline std::atomic<int>* block_refcount(const unsigned char* block)
+{
+    return (std::atomic<int>*)(block - block_header_bytes);
+}
+
+unsigned short float32_to_float16(float value)
+{
+    unsigned int x;
+    memcpy(&x, &value, sizeof(x));
+
+    const unsigned short sign = (unsigned short)((x >> 16) & 0x8000);
+    const unsigned int absx = x & 0x7fffffff;
+
+    // inf and nan, nan stays quiet
+    if (absx >= 0x7f800000)
+        return sign | 0x7c00 | (absx > 0x7f800000 ? 0x0200 : 0);
+    // too large even before rounding
+    if (absx >= 0x47800000)
+        return sign | 0x7c00;
+
+    // below 2^-14 the half is subnormal, count in units of 2^-24
+    if (absx < 0x38800000)
+    {
+        if (absx < 0x33000000)
+            return sign;
+
+        const int shift = 126 - (int)(absx >> 23);
+        const unsigned int m = (absx & 0x7fffff) | 0x800000;
+        unsigned int h = m >> shift;
+        const unsigned int rem = m & ((1u << shift) - 1);
+        const unsigned int half = 1u << (shift - 1);
+        if (rem > half || (rem == half && (h & 1)))
+            h++;
+        return sign | (unsigned short)h;
+    }
+
+    // rebias the exponent, a carry out of the mantissa rounds up into the exponent or to inf
+    unsigned int h = (absx - 0x38000000) >> 13;
+    const unsigned int rem = absx & 0x1fff;
+    if (rem > 0x1000 || (rem == 0x1000 && (h & 1)))
+        h++;
+    return sign | (unsigned short)h;
+}
+
+static size_t kv_row_bytes(int type, int n_embd, int n_head)
+{
+    if (type == KV_FP16)
+        return (size_t)n_embd * 2;
+    if (type == KV_INT8)
+        return ((size_t)n_head * sizeof(float) + n_embd + 3) & ~(size_t)3;
+    return (size_t)n_embd * sizeof(float);
+}
+
+static void store_row(unsigned char* row, const float* x, int type, int n_embd, int n_head)
+{
+    if (type == KV_FP16)
+    {
+        unsigned short* ptr = (unsigned short*)row;
+        for (int i = 0; i < n_embd; i++)
+            ptr[i] = float32_to_float16(x[i]);
+    }
+    else if (type == KV_INT8)
+    {
+        // symmetric, one scale per head of this position
+        const int head_dim = n_embd / n_head;
+        float* scales = (float*)row;
+        signed char* ptr = (signed char*)(row + n_head * sizeof(float));
+        for (int h = 0; h < n_head; h++)
+        {
+            const float* xh = x + h * head_dim;
+            float absmax = 0.f;
+            for (int d = 0; d < head_dim; d++)
+                absmax = std::max(absmax, fabsf(xh[d]));
+
+            const float scale = absmax / 127.f;
+            const float inv = absmax > 0.f ? 127.f / absmax : 0.f;
+            scales[h] = scale;
+            for (int d = 0; d < head_dim; d++)
+                ptr[h * head_dim + d] = (signed char)lrintf(xh[d] * inv);
+        }
+    }
+    else
+    {
+        memcpy(row, x, n_embd * sizeof(float));
+    }
+}
+
+KVPool::KVPool()
+{
+    bs = 0;
+    nlayer = 0;
+    embd = 0;
+    nhead = 0;
+    kvtype = KV_FP32;
+    rowbytes = 0;
+    max_blocks = 0;
+    nused = 0;
+    nallocated = 0;
+}
+
+KVPool::~KVPool()
+{
+    trim();
+}
+
+int KVPool::create(const ModelConfig& config, int block_size, int _max_blocks, int type)
+{
+    if (type != KV_FP32 && type != KV_FP16 && type != KV_INT8)
+        return -1;
+
+    std::lock_guard<std::mutex> g(lock);
+    if (nused != 0)
+        return -1;
+
+    for (size_t i = 0; i < free_blocks.size(); i++)
+        ::free(free_blocks[i] - block_header_bytes);
+    free_blocks.clear();
+    nallocated = 0;
+
+    bs = block_size;
+    nlayer = config.n_layer;
+    embd = config.n_embd;
+    nhead = config.n_head;
+    kvtype = type;
+    rowbytes = kv_row_bytes(type, embd, nhead);
+    max_blocks = _max_blocks;
+    return 0;
+}
+
+unsigned char* KVPool::alloc()
+{
+    std::lock_guard<std::mutex> g(lock);
+
+    if (!free_blocks.empty())
+    {
+        unsigned char* block = free_blocks.back();
+        free_blocks.pop_back();
+        block_refcount(block)->store(1);
+        nused++;
+        return block;
+    }
+
+    if (rowbytes == 0 || (max_blocks > 0 && nallocated >= max_blocks))
+        return 0;
+
+    unsigned char* ptr = (unsigned char*)malloc(block_header_bytes + block_bytes());
+    if (!ptr)
+        return 0;
+
+    unsigned char* block = ptr + block_header_bytes;
+    new (block_refcount(block)) std::atomic<int>(1);
+
+    nallocated++;
+    nused++;
+    return block;
+}
+
+void KVPool::retain(unsigned char* block)
+{
+    block_refcount(block)->fetch_add(1);
+}
+
+void KVPool::release(unsigned char* block)
+{
+    if (block_refcount(block)->fetch_sub(1) != 1)
+        return;
+
+    std::lock_guard<std::mutex> g(lock);
+    free_blocks.push_back(block);
+    nused--;
+}
+
+int KVPool::refcount(const unsigned char* block) const
+{
+    return block_refcount(block)->load();
+}
+
+void KVPool::trim()
+{
+    std::lock_guard<std::mutex> g(lock);
+    for (size_t i = 0; i < free_blocks.size(); i++)
+        ::free(free_blocks[i] - block_header_bytes);
+    nallocated -= (int)free_blocks.size();
+    free_blocks.clear();
+}
+
+int KVPool::used_blocks() const
+{
+    std::lock_guard<std::mutex> g(lock);
+    return nused;
+}
+
+int KVPool::allocated_blocks() const
+{
+    std::lock_guard<std::mutex> g(lock);
+    return nallocated;
+}
+
+KVCache::KVCache()
+{
+    pool = 0;
+    n_embd = 0;
+    n_head = 0;
+    kvtype = KV_FP32;
+    rowbytes = 0;
+    bs = 1;
+    cap = 0;
+    len = 0;
+}
+
+KVCache::~KVCache()
+{
+    resize(0);
+}
+
+int KVCache::create(const ModelConfig& config, KVPool* _pool)
+{
+    resize(0);
+
+    if (_pool->n_layer() != config.n_layer || _pool->n_embd() != config.n_embd)
+        return -1;
+
+    pool = _pool;
+    n_embd = config.n_embd;
+    n_head = config.n_head;
+    kvtype = pool->type();
+    rowbytes = pool->row_bytes();
+    bs = pool->block_size();
+    cap = config.n_ctx;
+    len = 0;
+    blocks.reserve((cap + bs - 1) / bs);
+    return 0;
+}
+
+int KVCache::reserve(int size)
+{
+    if (size > cap)
+        return -1;
+
+    // copy on write, positions before len stay shared with the other owners
+    const int partial = len % bs;
+    if (size > len && partial != 0 && pool->refcount(blocks[len / bs]) > 1)
+    {
+        unsigned char* shared = blocks[len / bs];
+        unsigned char* block = pool->alloc();
+        if (!block)
+            return -100;
+
+        const int nlayer = pool->n_layer();
+        for (int i = 0; i < nlayer * 2; i++)
+            memcpy(block + (size_t)i * bs * rowbytes, shared + (size_t)i * bs * rowbytes, partial * rowbytes);
+
+        blocks[len / bs] = block;
+        pool->release(shared);
+    }
+
+    while ((int)blocks.size() * bs < size)
+    {
+        unsigned char* block = pool->alloc();
+        if (!block)
+            return -100;
+        blocks.push_back(block);
+    }
+    return 0;
+}
+
+void KVCache::swap(KVCache& other)
+{
+    std::swap(pool, other.pool);
+    std::swap(n_embd, other.n_embd);
+    std::swap(n_head, other.n_head);
+    std::swap(kvtype, other.kvtype);
+    std::swap(rowbytes, other.rowbytes);
+    std::swap(bs, other.bs);
+    std::swap(cap, other.cap);
+    std::swap(len, other.len);
+    blocks.swap(other.blocks);
+}
+
+int KVCache::attach(unsigned char* const* _blocks, int count)
+{
+    if (!blocks.empty() || count * bs > cap)
+        return -1;
+
+    for (int i = 0; i < count; i++)
+    {
+        pool->retain(_blocks[i]);
+        blocks.push_back(_blocks[i]);
+    }
+    len = count * bs;
+    return 0;
+}
+
+void KVCache::store(int layer, int pos, const float* key, const float* value)
+{
+    unsigned char* kptr = blocks[pos / bs] + ((size_t)layer * 2 * bs + pos % bs) * rowbytes;
+    unsigned char* vptr = kptr + (size_t)bs * rowbytes;
+    store_row(kptr, key, kvtype, n_embd, n_head);
+    store_row(vptr, value, kvtype, n_embd, n_head);
+}
+
+void KVCache::resize(int size)
+{
+    if (size < 0)
+        size = 0;
+    if (size > (int)blocks.size() * bs)
+        return;
+
+    len = size;
+
+    const int nblock = (len + bs - 1) / bs;
+    while ((int)blocks.size() > nblock)
+    {
+        pool->release(blocks.back());
+        blocks.pop_back();
+    }
+}
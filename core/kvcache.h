@@ -0,0 +1,174 @@
+#ifndef KVCACHE_H
+#define KVCACHE_H
+
+#include <mutex>
+#include <stddef.h>
+#include <string.h>
+#include <vector>
+
+struct ModelConfig;
+
+// storage of the cached keys and values
+// int8 rows carry one float scale per head in front of the values, so appending a position never rescales the others
+enum KVType
+{
+    KV_FP32 = 0,
+    KV_FP16 = 1,
+    KV_INT8 = 2
+};
+
+// ieee half precision, round to nearest even
+unsigned short float32_to_float16(float value);
+
+static inline float float16_to_float32(unsigned short value)
+{
+    const unsigned int sign = (unsigned int)(value & 0x8000) << 16;
+    unsigned int exponent = (value >> 10) & 0x1f;
+    unsigned int significand = value & 0x3ff;
+
+    unsigned int x;
+    if (exponent == 0 && significand == 0)
+    {
+        x = sign;
+    }
+    else if (exponent == 0)
+    {
+        // subnormal, normalize
+        exponent = 113;
+        while (!(significand & 0x400))
+        {
+            significand <<= 1;
+            exponent--;
+        }
+        x = sign | (exponent << 23) | ((significand & 0x3ff) << 13);
+    }
+    else if (exponent == 0x1f)
+    {
+        x = sign | 0x7f800000 | (significand << 13);
+    }
+    else
+    {
+        x = sign | ((exponent + 112) << 23) | (significand << 13);
+    }
+
+    float f;
+    memcpy(&f, &x, sizeof(f));
+    return f;
+}
+
+// fixed size kv blocks shared by the sessions of a process
+// a block holds block_size positions of every layer, laid out [layer][key|value][block_size][row]
+// a row is the n_embd values of one position in the pool type
+// blocks are refcounted so that caches can share full blocks of a common prefix, all calls are thread-safe
+class KVPool
+{
+public:
+    KVPool();
+    ~KVPool();
+
+    // max_blocks 0 means no limit
+    // fp16 halves and int8 roughly quarters the bytes attention reads per position
+    int create(const ModelConfig& config, int block_size = 16, int max_blocks = 0, int type = KV_FP32);
+
+    // null once max_blocks are in use, the new block has one reference
+    unsigned char* alloc();
+    void retain(unsigned char* block);
+    // the block is reused once the last reference is gone
+    void release(unsigned char* block);
+    int refcount(const unsigned char* block) const;
+
+    // give the cached free blocks back to the system
+    void trim();
+
+    int block_size() const { return bs; }
+    int n_layer() const { return nlayer; }
+    int n_embd() const { return embd; }
+    int n_head() const { return nhead; }
+    int type() const { return kvtype; }
+    size_t row_bytes() const { return rowbytes; }
+    size_t block_bytes() const { return (size_t)nlayer * 2 * bs * rowbytes; }
+
+    int used_blocks() const;
+    int allocated_blocks() const;
+
+private:
+    KVPool(const KVPool&);
+    KVPool& operator=(const KVPool&);
+
+private:
+    int bs;
+    int nlayer;
+    int embd;
+    int nhead;
+    int kvtype;
+    size_t rowbytes;
+    int max_blocks;
+
+    mutable std::mutex lock;
+    int nused;
+    int nallocated;
+    std::vector<unsigned char*> free_blocks;
+};
+
+// keys and values of the positions a session has already run, one sequence
+// positions live in pool blocks found through a block table, memory follows the context length
+class KVCache
+{
+public:
+    KVCache();
+    ~KVCache();
+
+    // blocks come from pool, which must outlive the cache
+    int create(const ModelConfig& config, KVPool* pool);
+
+    // cached positions
+    int size() const { return len; }
+    // positions the model can address
+    int capacity() const { return cap; }
+
+    // have blocks for size positions, -100 if the pool is exhausted
+    // a shared block that the next position would be written to is copied first
+    int reserve(int size);
+    // drop every position from size on, whole blocks go back to the pool
+    // growing is only valid up to the reserved size
+    void resize(int size);
+    void clear() { resize(0); }
+
+    void swap(KVCache& other);
+
+    // share the full blocks of another cache, which must hold the same prefix, the cache must be empty
+    int attach(unsigned char* const* blocks, int count);
+
+    int block_size() const { return bs; }
+    int block_count() const { return (int)blocks.size(); }
+    unsigned char* block(int i) const { return blocks[i]; }
+
+    // storage of the rows, KVType
+    int type() const { return kvtype; }
+    size_t row_bytes() const { return rowbytes; }
+
+    // convert the key and value of a reserved position to the storage type
+    void store(int layer, int pos, const float* key, const float* value);
+
+    // the block_size rows from pos on that share one block are contiguous, row_bytes apart
+    const unsigned char* key(int layer, int pos) const { return blocks[pos / bs] + ((size_t)layer * 2 * bs + pos % bs) * rowbytes; }
+    const unsigned char* value(int layer, int pos) const { return blocks[pos / bs] + ((size_t)(layer * 2 + 1) * bs + pos % bs) * rowbytes; }
+
+private:
+    KVCache(const KVCache&);
+    KVCache& operator=(const KVCache&);
+
+private:
+    KVPool* pool;
+    int n_embd;
+    int n_head;
+    int kvtype;
+    size_t rowbytes;
+    int bs;
+    int cap;
+    int len;
+    // block table
+    std::vector<unsigned char*> blocks;
+};
+
+#endif // KVCACHE_H
@@ -0,0 +1,227 @@
+#include "mappedfile.h"
+
+#include <algorithm>
+#include <stdio.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+MappedFile::MappedFile()
+{
+    ptr = 0;
+    len = 0;
+#ifdef _WIN32
+    file = INVALID_HANDLE_VALUE;
+    mapping = 0;
+#else
+    mapped = false;
+#endif
+#if __ANDROID_API__ >= 9
+    asset = 0;
+#endif
+}
+
+MappedFile::~MappedFile()
+{
+    close();
+}
+
+void MappedFile::swap(MappedFile& other)
+{
+    std::swap(ptr, other.ptr);
+    std::swap(len, other.len);
+#ifdef _WIN32
+    std::swap(file, other.file);
+    std::swap(mapping, other.mapping);
+#else
+    std::swap(mapped, other.mapped);
+#endif
+#if __ANDROID_API__ >= 9
+    std::swap(asset, other.asset);
+#endif
+}
+
+int MappedFile::open(const char* path)
+{
+    close();
+
+#ifdef _WIN32
+    file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+    {
+        fprintf(stderr, "open %s failed\n", path);
+        return -1;
+    }
+
+    LARGE_INTEGER filesize;
+    if (!GetFileSizeEx((HANDLE)file, &filesize) || filesize.QuadPart == 0)
+    {
+        close();
+        return -1;
+    }
+
+    mapping = CreateFileMappingA((HANDLE)file, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (!mapping)
+    {
+        close();
+        return -1;
+    }
+
+    ptr = MapViewOfFile((HANDLE)mapping, FILE_MAP_READ, 0, 0, 0);
+    if (!ptr)
+    {
+        close();
+        return -1;
+    }
+    len = (size_t)filesize.QuadPart;
+#else
+    int fd = ::open(path, O_RDONLY);
+    if (fd < 0)
+    {
+        fprintf(stderr, "open %s failed\n", path);
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0)
+    {
+        ::close(fd);
+        return -1;
+    }
+
+    void* p = mmap(0, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (p == MAP_FAILED)
+    {
+        fprintf(stderr, "mmap %s failed\n", path);
+        return -1;
+    }
+
+    ptr = p;
+    len = (size_t)st.st_size;
+    mapped = true;
+#endif
+
+    return 0;
+}
+
+#if __ANDROID_API__ >= 9
+int MappedFile::open(AAssetManager* mgr, const char* assetpath)
+{
+    close();
+
+    asset = AAssetManager_open(mgr, assetpath, AASSET_MODE_BUFFER);
+    if (!asset)
+        return -1;
+
+    ptr = AAsset_getBuffer(asset);
+    len = (size_t)AAsset_getLength(asset);
+    if (!ptr)
+    {
+        close();
+        return -1;
+    }
+
+    return 0;
+}
+#endif
+
+void MappedFile::close()
+{
+#if __ANDROID_API__ >= 9
+    if (asset)
+    {
+        AAsset_close(asset);
+        asset = 0;
+        ptr = 0;
+    }
+#endif
+
+#ifdef _WIN32
+    if (ptr)
+        UnmapViewOfFile(ptr);
+    if (mapping)
+        CloseHandle((HANDLE)mapping);
+    if (file != INVALID_HANDLE_VALUE)
+        CloseHandle((HANDLE)file);
+    mapping = 0;
+    file = INVALID_HANDLE_VALUE;
+#else
+    if (mapped)
+        munmap((void*)ptr, len);
+    mapped = false;
+#endif
+
+    ptr = 0;
+    len = 0;
+}
+
+#ifndef _WIN32
+// the range grown to whole pages, madvise and mincore take page aligned addresses
+static void page_range(const void* addr, size_t size, unsigned char** begin, size_t* length)
+{
+    const size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    const size_t start = (size_t)addr & ~(page - 1);
+    const size_t end = ((size_t)addr + size + page - 1) & ~(page - 1);
+    *begin = (unsigned char*)start;
+    *length = end - start;
+}
+#endif
+
+int MappedFile::advise(const void* addr, size_t size, int advice) const
+{
+#ifdef _WIN32
+    (void)addr;
+    (void)size;
+    (void)advice;
+    return -1;
+#else
+    if (!mapped || size == 0 || !contains(addr, size))
+        return -1;
+
+    unsigned char* begin;
+    size_t length;
+    page_range(addr, size, &begin, &length);
+
+    // the mapping is private and never written, a dropped page comes back from the file unchanged
+    return madvise(begin, length, advice == ADVICE_DONTNEED ? MADV_DONTNEED : MADV_WILLNEED) == 0 ? 0 : -1;
+#endif
+}
+
+bool MappedFile::resident(const void* addr, size_t size) const
+{
+#ifdef _WIN32
+    (void)addr;
+    (void)size;
+    return true;
+#else
+    if (!mapped || size == 0 || !contains(addr, size))
+        return true;
+
+    unsigned char* begin;
+    size_t length;
+    page_range(addr, size, &begin, &length);
+
+    // a few pages at a time on the stack, a block of weights has thousands
+    const size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    unsigned char vec[256];
+    for (size_t offset = 0; offset < length; offset += sizeof(vec) * page)
+    {
+        const size_t n = std::min(length - offset, sizeof(vec) * page);
+        if (mincore(begin + offset, n, vec) != 0)
+            return true;
+        for (size_t i = 0; i < (n + page - 1) / page; i++)
+        {
+            if (!(vec[i] & 1))
+                return false;
+        }
+    }
+    return true;
+#endif
+}
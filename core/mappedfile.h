@@ -0,0 +1,63 @@
+#ifndef MAPPEDFILE_H
+#define MAPPEDFILE_H
+
+#include <stddef.h>
+
+#if __ANDROID_API__ >= 9
+#include <android/asset_manager.h>
+#endif
+
+enum MappedAdvice
+{
+    ADVICE_WILLNEED = 0, // start reading the pages in
+    ADVICE_DONTNEED = 1  // drop the pages from this process, they are read back when touched
+};
+
+// read-only file mapping, the pages are shared with the page cache
+class MappedFile
+{
+public:
+    MappedFile();
+    ~MappedFile();
+
+    int open(const char* path);
+#if __ANDROID_API__ >= 9
+    // assets stored uncompressed in the apk are mapped, compressed ones get inflated into memory
+    int open(AAssetManager* mgr, const char* assetpath);
+#endif
+    void close();
+
+    // a new file is opened aside and swapped in, the old one stays mapped until its users let go
+    void swap(MappedFile& other);
+
+    const unsigned char* data() const { return (const unsigned char*)ptr; }
+    size_t size() const { return len; }
+    bool empty() const { return ptr == 0; }
+    bool contains(const void* addr, size_t size) const { return ptr && (const unsigned char*)addr >= data() && (const unsigned char*)addr + size <= data() + len; }
+
+    // page hints for a range of the mapping, only a file mapped by path takes them,
+    // -1 for an asset buffer or on windows, where the pages are left as they are
+    int advise(const void* addr, size_t size, int advice) const;
+    // every page of the range is in the page cache, also true where that cannot be told
+    bool resident(const void* addr, size_t size) const;
+
+private:
+    MappedFile(const MappedFile&);
+    MappedFile& operator=(const MappedFile&);
+
+private:
+    const void* ptr;
+    size_t len;
+
+#ifdef _WIN32
+    void* file;
+    void* mapping;
+#else
+    bool mapped;
+#endif
+#if __ANDROID_API__ >= 9
+    AAsset* asset;
+#endif
+};
+
+#endif // MAPPEDFILE_H
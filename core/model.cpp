@@ -0,0 +1,1828 @@
+#include "model.h"
+
+#include "kvcache.h"
+#include "package.h"
+#include "threadpool.h"
+
+#include <algorithm>
+#include <chrono>
+#include <ctype.h>
+#include <functional>
+#include <map>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+
+// msvc has no __F16C__, every avx2 cpu has f16c
+#if __AVX2__ && (__F16C__ || defined(_MSC_VER))
+#include <immintrin.h>
+#define KV_AVX2 1
+#elif __ARM_NEON && __aarch64__
+#include <arm_neon.h>
+#define KV_NEON 1
+#endif
+
+// a panel is four vector registers wide, the outputs of one row stay in registers over the whole gemm
+#if __AVX512F__
+#define GEMM_ISA "avx512"
+#define GEMM_PANEL 64
+#elif __AVX2__
+#define GEMM_ISA "avx2"
+#define GEMM_PANEL 32
+#elif __ARM_NEON
+#define GEMM_ISA "neon"
+#define GEMM_PANEL 16
+#else
+#define GEMM_ISA "generic"
+#define GEMM_PANEL 16
+#endif
+
+#ifdef _WIN32
+#include <malloc.h>
+#else
+#include <sys/mman.h>
+#endif
+
+// one line of the ncnn param file
+struct ParamLayer
+{
+    std::string type;
+    std::string name;
+    std::vector<std::string> bottoms;
+    std::vector<std::string> tops;
+    std::map<int, std::string> params;
+
+    int get(int id, int def) const
+    {
+        std::map<int, std::string>::const_iterator it = params.find(id);
+        return it == params.end() ? def : atoi(it->second.c_str());
+    }
+    float get(int id, float def) const
+    {
+        std::map<int, std::string>::const_iterator it = params.find(id);
+        return it == params.end() ? def : (float)atof(it->second.c_str());
+    }
+};
+
+static int parse_param(const char* param, size_t size, std::vector<ParamLayer>& layers)
+{
+    std::vector<std::string> lines;
+    size_t pos = 0;
+    while (pos < size)
+    {
+        size_t end = pos;
+        while (end < size && param[end] != '\n')
+            end++;
+        lines.push_back(std::string(param + pos, end - pos));
+        pos = end + 1;
+    }
+
+    // 7767517
+    // layer_count blob_count
+    if (lines.size() < 2 || atoi(lines[0].c_str()) != 7767517)
+    {
+        fprintf(stderr, "param is too old, please regenerate\n");
+        return -1;
+    }
+
+    int layer_count = 0;
+    int blob_count = 0;
+    if (sscanf(lines[1].c_str(), "%d %d", &layer_count, &blob_count) != 2 || layer_count <= 0 || (int)lines.size() < 2 + layer_count)
+        return -1;
+
+    layers.resize(layer_count);
+    for (int i = 0; i < layer_count; i++)
+    {
+        std::vector<std::string> words;
+        const std::string& line = lines[2 + i];
+        size_t p = 0;
+        while (p < line.size())
+        {
+            while (p < line.size() && isspace((unsigned char)line[p]))
+                p++;
+            size_t q = p;
+            while (q < line.size() && !isspace((unsigned char)line[q]))
+                q++;
+            if (q > p)
+                words.push_back(line.substr(p, q - p));
+            p = q;
+        }
+
+        if (words.size() < 4)
+            return -1;
+
+        ParamLayer& layer = layers[i];
+        layer.type = words[0];
+        layer.name = words[1];
+        int bottom_count = atoi(words[2].c_str());
+        int top_count = atoi(words[3].c_str());
+        if (bottom_count < 0 || top_count < 0 || words.size() < 4 + (size_t)bottom_count + top_count)
+            return -1;
+
+        layer.bottoms.assign(words.begin() + 4, words.begin() + 4 + bottom_count);
+        layer.tops.assign(words.begin() + 4 + bottom_count, words.begin() + 4 + bottom_count + top_count);
+
+        for (size_t j = 4 + bottom_count + top_count; j < words.size(); j++)
+        {
+            size_t eq = words[j].find('=');
+            if (eq == std::string::npos)
+                return -1;
+            layer.params[atoi(words[j].substr(0, eq).c_str())] = words[j].substr(eq + 1);
+        }
+    }
+
+    return 0;
+}
+
+// sequential reader over the ncnn bin, same order and encoding as ncnn::ModelBinFromDataReader
+// the weights section of a package has no flags and every tensor starts 64 byte aligned
+// every tensor read is listed in tensors, in order
+class WeightReader
+{
+public:
+    WeightReader(const unsigned char* _mem, size_t _size, bool _packed, std::vector<std::pair<const float*, size_t> >& _tensors)
+        : mem(_mem), size(_size), offset(0), packed(_packed), tensors(_tensors)
+    {
+        tensors.clear();
+    }
+
+    // type 1, raw fp32
+    const float* load_raw(size_t count)
+    {
+        if (packed)
+            offset = std::min((offset + 63) & ~(size_t)63, size);
+        if (count > (size - offset) / sizeof(float))
+            return 0;
+        const float* p = (const float*)(mem + offset);
+        offset += count * sizeof(float);
+        tensors.push_back(std::make_pair(p, count));
+        return p;
+    }
+
+    // type 0, 4 byte flag then data, only plain fp32 is supported
+    const float* load_flagged(size_t count)
+    {
+        if (packed)
+            return load_raw(count);
+        if (size - offset < 4)
+            return 0;
+        unsigned int flag;
+        memcpy(&flag, mem + offset, 4);
+        if (flag != 0 && flag != 0x0002C056)
+        {
+            fprintf(stderr, "weight flag %08x is not fp32, reconvert the model without fp16 or int8 storage\n", flag);
+            return 0;
+        }
+        offset += 4;
+        return load_raw(count);
+    }
+
+    size_t tell() const { return offset; }
+
+private:
+    const unsigned char* mem;
+    size_t size;
+    size_t offset;
+    bool packed;
+    std::vector<std::pair<const float*, size_t> >& tensors;
+};
+
+struct MemoryDataShape
+{
+    const float* data;
+    int w;
+    int h;
+};
+
+Model::Model()
+{
+    memset(&cfg, 0, sizeof(cfg));
+    wte = 0;
+    wpe = 0;
+    ln_f_gamma = 0;
+    ln_f_beta = 0;
+    lm_head_w = 0;
+    lm_head_b = 0;
+    all_ready = true;
+    next_region = 0;
+    stop_loading = false;
+    memory_budget = 0;
+    paged_from = 0;
+    stall_count = 0;
+    stall_us = 0;
+    package_file = 0;
+}
+
+Model::~Model()
+{
+    release_replicas();
+    stop_streaming();
+}
+
+int Model::load(const char* parampath, const char* binpath)
+{
+    stop_streaming();
+
+    MappedFile param;
+    if (param.open(parampath) != 0)
+        return -1;
+
+    // a failed open leaves the loaded weights in place, the old mapping goes once bind let go of it
+    MappedFile weights;
+    if (weights.open(binpath) != 0)
+        return -1;
+
+    blob.clear();
+    package_file = 0;
+    weights_file.swap(weights);
+
+    return load_mapped((const char*)param.data(), param.size());
+}
+
+#if __ANDROID_API__ >= 9
+int Model::load(AAssetManager* mgr, const char* parampath, const char* binpath)
+{
+    stop_streaming();
+
+    MappedFile param;
+    if (param.open(mgr, parampath) != 0)
+        return -1;
+
+    MappedFile weights;
+    if (weights.open(mgr, binpath) != 0)
+        return -1;
+
+    blob.clear();
+    package_file = 0;
+    weights_file.swap(weights);
+
+    return load_mapped((const char*)param.data(), param.size());
+}
+#endif
+
+int Model::load(const char* param, size_t param_size, const unsigned char* bin, size_t bin_size)
+{
+    stop_streaming();
+    weights_file.close();
+    package_file = 0;
+    blob.assign(bin, bin + bin_size);
+    region_crcs.clear();
+    return bind(param, param_size, blob.data(), blob.size(), false);
+}
+
+int Model::load(const Package& package)
+{
+    stop_streaming();
+    weights_file.close();
+    package_file = &package.mapping();
+    blob.clear();
+    region_crcs.clear();
+
+    size_t config_size = 0;
+    size_t param_size = 0;
+    size_t weights_size = 0;
+    const unsigned char* config = package.section(SECTION_CONFIG, &config_size);
+    const unsigned char* param = package.section(SECTION_PARAM, &param_size);
+    const unsigned char* weights = package.section(SECTION_WEIGHTS, &weights_size);
+    if (!config || config_size != sizeof(ModelConfig) || !param || !weights)
+    {
+        fprintf(stderr, "gpt2 package without config, param or weights\n");
+        return -1;
+    }
+
+    // an apk asset may sit at any 4 byte boundary, the offsets inside are relative to it
+    if (((size_t)weights & 3) != 0)
+    {
+        fprintf(stderr, "gpt2 package is not aligned, copying the weights\n");
+        blob.assign(weights, weights + weights_size);
+        weights = blob.data();
+    }
+
+    if (bind((const char*)param, param_size, weights, weights_size, true) != 0)
+        return -1;
+
+    // the param has to describe the model the weights were packed for
+    ModelConfig packed;
+    memcpy(&packed, config, sizeof(packed));
+    if (packed.n_layer != cfg.n_layer || packed.n_head != cfg.n_head || packed.n_embd != cfg.n_embd || packed.n_inner != cfg.n_inner || packed.n_vocab != cfg.n_vocab || packed.n_ctx != cfg.n_ctx)
+    {
+        fprintf(stderr, "gpt2 package config does not match its param\n");
+        blocks.clear();
+        return -1;
+    }
+
+    // optional, one crc per region, checked while streaming
+    size_t checksums_size = 0;
+    const unsigned char* checksums = package.section(SECTION_CHECKSUMS, &checksums_size);
+    if (checksums && checksums_size == (size_t)region_count() * sizeof(unsigned int))
+    {
+        region_crcs.resize(region_count());
+        memcpy(region_crcs.data(), checksums, checksums_size);
+    }
+
+    return 0;
+}
+
+int Model::pack_weights(std::vector<unsigned char>& weights) const
+{
+    weights.clear();
+    if (tensors.empty())
+        return -1;
+
+    size_t size = 0;
+    for (size_t i = 0; i < tensors.size(); i++)
+        size = ((size + 63) & ~(size_t)63) + tensors[i].second * sizeof(float);
+
+    weights.assign(size, 0);
+    size_t offset = 0;
+    for (size_t i = 0; i < tensors.size(); i++)
+    {
+        offset = (offset + 63) & ~(size_t)63;
+        memcpy(weights.data() + offset, tensors[i].first, tensors[i].second * sizeof(float));
+        offset += tensors[i].second * sizeof(float);
+    }
+    return 0;
+}
+
+int Model::load_mapped(const char* param, size_t param_size)
+{
+    region_crcs.clear();
+
+    // the weights stay in the mapping, its pages are shared with the page cache and with every process that maps the file
+    // only an asset that is not 4 byte aligned inside the apk gets copied
+    if (((size_t)weights_file.data() & 3) != 0)
+    {
+        fprintf(stderr, "gpt2 bin is not aligned, copying the weights\n");
+        blob.assign(weights_file.data(), weights_file.data() + weights_file.size());
+        weights_file.close();
+        return bind(param, param_size, blob.data(), blob.size(), false);
+    }
+
+    return bind(param, param_size, weights_file.data(), weights_file.size(), false);
+}
+
+int Model::bind(const char* param, size_t param_size, const unsigned char* bin, size_t bin_size, bool packed)
+{
+    {
+        std::lock_guard<std::mutex> g(ready_lock);
+        region_state.clear();
+        all_ready = true;
+    }
+
+    blocks.clear();
+    memset(&cfg, 0, sizeof(cfg));
+    wte = 0;
+    wpe = 0;
+    release_replicas();
+    panels_cache.close();
+    panels_blob.clear();
+    memory_budget = 0;
+    paged_from = 0;
+
+    std::vector<ParamLayer> layers;
+    if (parse_param(param, param_size, layers) != 0)
+    {
+        fprintf(stderr, "parse param failed\n");
+        return -1;
+    }
+
+    // the weights are used in place, offsets inside the bin stay 4 byte aligned
+    WeightReader mb(bin, bin_size, packed, tensors);
+
+    std::map<std::string, MemoryDataShape> memorydata;
+    std::vector<const ParamLayer*> gemms;
+    std::vector<const ParamLayer*> gathers;
+    std::vector<const float*> layernorms;
+    const ParamLayer* innerproduct = 0;
+
+    for (size_t i = 0; i < layers.size(); i++)
+    {
+        const ParamLayer& layer = layers[i];
+
+        if (layer.type == "MemoryData")
+        {
+            MemoryDataShape shape;
+            shape.w = layer.get(0, 0);
+            shape.h = layer.get(1, 0);
+            int c = layer.get(2, 0);
+            shape.data = mb.load_raw((size_t)shape.w * std::max(shape.h, 1) * std::max(c, 1));
+            if (!shape.data || layer.tops.size() != 1)
+                break;
+            memorydata[layer.tops[0]] = shape;
+        }
+        else if (layer.type == "LayerNorm")
+        {
+            int affine_size = layer.get(0, 0);
+            if (layer.get(2, 1) == 0)
+            {
+                fprintf(stderr, "LayerNorm %s without affine\n", layer.name.c_str());
+                return -1;
+            }
+            const float* gamma = mb.load_raw(affine_size);
+            const float* beta = mb.load_raw(affine_size);
+            if (!gamma || !beta)
+                break;
+            layernorms.push_back(gamma);
+            layernorms.push_back(beta);
+
+            if (cfg.n_embd == 0)
+            {
+                cfg.n_embd = affine_size;
+                cfg.eps = layer.get(1, 0.001f);
+            }
+        }
+        else if (layer.type == "InnerProduct")
+        {
+            int num_output = layer.get(0, 0);
+            int bias_term = layer.get(1, 0);
+            int weight_data_size = layer.get(2, 0);
+            lm_head_w = mb.load_flagged(weight_data_size);
+            lm_head_b = bias_term ? mb.load_raw(num_output) : 0;
+            if (!lm_head_w || (bias_term && !lm_head_b))
+                break;
+            innerproduct = &layer;
+        }
+        else if (layer.type == "Gemm")
+        {
+            gemms.push_back(&layer);
+        }
+        else if (layer.type == "Gather")
+        {
+            gathers.push_back(&layer);
+        }
+        else if (layer.type == "Reshape")
+        {
+            // the first head split, 0=head_dim 1=n_head 2=-1
+            if (cfg.n_head == 0 && layer.get(2, 0) == -1 && layer.get(0, 0) > 0 && layer.get(1, 0) > 0 && layer.get(0, 0) * layer.get(1, 0) == cfg.n_embd)
+                cfg.n_head = layer.get(1, 0);
+        }
+        else if (layer.type == "Convolution" || layer.type == "ConvolutionDepthWise" || layer.type == "Deconvolution" || layer.type == "Embed" || layer.type == "BatchNorm" || layer.type == "Scale")
+        {
+            fprintf(stderr, "unexpected layer %s %s in gpt2 param\n", layer.type.c_str(), layer.name.c_str());
+            return -1;
+        }
+    }
+
+    if (!innerproduct || mb.tell() != bin_size)
+    {
+        fprintf(stderr, "bin size %d does not match param\n", (int)bin_size);
+        return -1;
+    }
+
+    cfg.n_layer = (int)gemms.size() / 4;
+    cfg.n_vocab = innerproduct->get(0, 0);
+    if (cfg.n_layer == 0 || (int)gemms.size() != cfg.n_layer * 4 || (int)layernorms.size() != (cfg.n_layer * 2 + 1) * 2 || gathers.size() != 2 || cfg.n_head == 0 || innerproduct->get(2, 0) != cfg.n_vocab * cfg.n_embd)
+    {
+        fprintf(stderr, "param is not a gpt2 decoder\n");
+        return -1;
+    }
+
+    // token and position tables, told apart by their row count
+    for (size_t i = 0; i < gathers.size(); i++)
+    {
+        std::map<std::string, MemoryDataShape>::const_iterator it = memorydata.find(gathers[i]->bottoms[0]);
+        if (it == memorydata.end() || it->second.w != cfg.n_embd)
+            return -1;
+        if (it->second.h == cfg.n_vocab && !wte)
+            wte = it->second.data;
+        else
+        {
+            wpe = it->second.data;
+            cfg.n_ctx = it->second.h;
+        }
+    }
+    if (!wte || !wpe)
+        return -1;
+
+    if (gemms[2]->bottoms.size() != 3 || !memorydata.count(gemms[2]->bottoms[1]))
+        return -1;
+    cfg.n_inner = memorydata[gemms[2]->bottoms[1]].w;
+
+    // x W b, the four gemms of a block are qkv, attention projection, fc, mlp projection
+    const int shapes[4][2] = {
+        {cfg.n_embd, cfg.n_embd * 3},
+        {cfg.n_embd, cfg.n_embd},
+        {cfg.n_embd, cfg.n_inner},
+        {cfg.n_inner, cfg.n_embd},
+    };
+    const float* gemm_w[4];
+    const float* gemm_b[4];
+    blocks.resize(cfg.n_layer);
+    for (int l = 0; l < cfg.n_layer; l++)
+    {
+        for (int j = 0; j < 4; j++)
+        {
+            const ParamLayer* gemm = gemms[l * 4 + j];
+            if (gemm->bottoms.size() != 3 || !memorydata.count(gemm->bottoms[1]) || !memorydata.count(gemm->bottoms[2]))
+            {
+                fprintf(stderr, "Gemm %s weights are not MemoryData\n", gemm->name.c_str());
+                return -1;
+            }
+            const MemoryDataShape& w = memorydata[gemm->bottoms[1]];
+            const MemoryDataShape& b = memorydata[gemm->bottoms[2]];
+            if (b.w != w.w || b.h > 1)
+                return -1;
+            gemm_w[j] = w.data;
+            gemm_b[j] = b.data;
+
+            if (w.h != shapes[j][0] || w.w != shapes[j][1])
+            {
+                fprintf(stderr, "Gemm %s shape %d x %d mismatch\n", gemm->name.c_str(), w.h, w.w);
+                return -1;
+            }
+        }
+
+        BlockWeights& block = blocks[l];
+        block.ln_1_gamma = layernorms[l * 4 + 0];
+        block.ln_1_beta = layernorms[l * 4 + 1];
+        block.attn_w = gemm_w[0];
+        block.attn_b = gemm_b[0];
+        block.proj_w = gemm_w[1];
+        block.proj_b = gemm_b[1];
+        block.ln_2_gamma = layernorms[l * 4 + 2];
+        block.ln_2_beta = layernorms[l * 4 + 3];
+        block.fc_w = gemm_w[2];
+        block.fc_b = gemm_b[2];
+        block.mlp_proj_w = gemm_w[3];
+        block.mlp_proj_b = gemm_b[3];
+    }
+    ln_f_gamma = layernorms[cfg.n_layer * 4 + 0];
+    ln_f_beta = layernorms[cfg.n_layer * 4 + 1];
+
+    fprintf(stderr, "gpt2 %d layers %d heads %d embd %d vocab %d ctx\n", cfg.n_layer, cfg.n_head, cfg.n_embd, cfg.n_vocab, cfg.n_ctx);
+
+    return 0;
+}
+
+Workspace::Workspace()
+{
+    x = 0;
+    xn = 0;
+    qkv = 0;
+    attn = 0;
+    inner = 0;
+    scores = 0;
+    row_item = 0;
+    row_pos = 0;
+    memset(plan, 0, sizeof(plan));
+    slab = 0;
+}
+
+int Workspace::reserve(const ModelConfig& config, int n, int num_threads)
+{
+    const size_t tokens = std::max(n, 1);
+    const size_t embd_bytes = tokens * config.n_embd * sizeof(float);
+    const size_t rows_bytes = tokens * sizeof(int);
+
+    // x carries the residual through every block, xn is the input and output of every gemm
+    const SlabBuffer buffers[WORKSPACE_BUFFERS] = {
+        {"x", embd_bytes, PHASE_EMBED, PHASE_HEAD, 0},
+        {"row_item", rows_bytes, PHASE_EMBED, PHASE_HEAD, 0},
+        {"row_pos", rows_bytes, PHASE_EMBED, PHASE_HEAD, 0},
+        {"xn", embd_bytes, PHASE_ATTENTION, PHASE_HEAD, 0},
+        {"qkv", embd_bytes * 3, PHASE_ATTENTION, PHASE_ATTENTION, 0},
+        {"attn", embd_bytes, PHASE_ATTENTION, PHASE_ATTENTION, 0},
+        {"scores", (size_t)std::max(num_threads, 1) * config.n_ctx * sizeof(float), PHASE_ATTENTION, PHASE_ATTENTION, 0},
+        {"inner", tokens * config.n_inner * sizeof(float), PHASE_MLP, PHASE_MLP, 0},
+    };
+    memcpy(plan, buffers, sizeof(plan));
+    slab = plan_slab(plan, WORKSPACE_BUFFERS);
+
+    if (arena.reserve(slab) != 0)
+        return -100;
+    unsigned char* base = (unsigned char*)arena.alloc(slab);
+
+    x = (float*)(base + plan[0].offset);
+    row_item = (int*)(base + plan[1].offset);
+    row_pos = (int*)(base + plan[2].offset);
+    xn = (float*)(base + plan[3].offset);
+    qkv = (float*)(base + plan[4].offset);
+    attn = (float*)(base + plan[5].offset);
+    scores = (float*)(base + plan[6].offset);
+    inner = (float*)(base + plan[7].offset);
+    return 0;
+}
+
+size_t Workspace::phase_bytes(int phase) const
+{
+    size_t bytes = 0;
+    for (int i = 0; i < WORKSPACE_BUFFERS; i++)
+    {
+        if (plan[i].first <= phase && phase <= plan[i].last)
+            bytes += Arena::aligned(plan[i].bytes);
+    }
+    return bytes;
+}
+
+static void layernorm(const float* x, int m, int n, const float* gamma, const float* beta, float eps, float* y)
+{
+    for (int i = 0; i < m; i++)
+    {
+        const float* ptr = x + (size_t)i * n;
+        float* outptr = y + (size_t)i * n;
+
+        float sum = 0.f;
+        for (int j = 0; j < n; j++)
+            sum += ptr[j];
+        float mean = sum / n;
+
+        float sqsum = 0.f;
+        for (int j = 0; j < n; j++)
+        {
+            float d = ptr[j] - mean;
+            sqsum += d * d;
+        }
+        float a = 1.f / sqrtf(sqsum / n + eps);
+
+        for (int j = 0; j < n; j++)
+            outptr[j] = (ptr[j] - mean) * a * gamma[j] + beta[j];
+    }
+}
+
+// the kernels hand their lambdas over by reference, a single pointer fits the small buffer of std::function
+// while a lambda with all its captures would be copied to the heap on every call
+template<typename F>
+static void parallel_for(ThreadPool* pool, int nt, int n, int grain, const F& fn)
+{
+    if (pool)
+        pool->parallel_for(n, grain, [&fn](int begin, int end, int thread) { fn(begin, end, thread); }, nt);
+    else
+        fn(0, n, 0);
+}
+
+// y = x w + b, x is m x k, w is k x n
+// every thread owns a strip of columns and streams it through all rows of w once for all m tokens
+static void gemm(const float* x, int m, int k, const float* w, const float* b, int n, float* y, ThreadPool* pool, int nt)
+{
+    const int tile = 64;
+    const int ntile = (n + tile - 1) / tile;
+
+    parallel_for(pool, nt, ntile, 1, [&](int t0, int t1, int) {
+        for (int t = t0; t < t1; t++)
+        {
+            const int n0 = t * tile;
+            const int nn = std::min(tile, n - n0);
+
+            for (int i = 0; i < m; i++)
+            {
+                float* outptr = y + (size_t)i * n + n0;
+                for (int j = 0; j < nn; j++)
+                    outptr[j] = b ? b[n0 + j] : 0.f;
+            }
+
+            for (int kk = 0; kk < k; kk++)
+            {
+                const float* wptr = w + (size_t)kk * n + n0;
+                for (int i = 0; i < m; i++)
+                {
+                    const float xv = x[(size_t)i * k + kk];
+                    float* outptr = y + (size_t)i * n + n0;
+                    for (int j = 0; j < nn; j++)
+                        outptr[j] += xv * wptr[j];
+                }
+            }
+        }
+    });
+}
+
+// y = x w + b with w reordered into panels by Model::prepack, panel p holds columns p * GEMM_PANEL on for all k rows
+// a single row sums a whole panel in registers, more rows go through memory as in gemm, the order of the sums is the same
+static void gemm_panels(const float* x, int m, int k, const float* panels, const float* b, int n, float* y, ThreadPool* pool, int nt)
+{
+    const int npanel = (n + GEMM_PANEL - 1) / GEMM_PANEL;
+
+    parallel_for(pool, nt, npanel, std::max(64 / GEMM_PANEL, 1), [&](int p0, int p1, int) {
+        for (int p = p0; p < p1; p++)
+        {
+            const float* panel = panels + (size_t)p * k * GEMM_PANEL;
+            const int n0 = p * GEMM_PANEL;
+            const int nn = std::min(GEMM_PANEL, n - n0);
+
+            if (m == 1)
+            {
+                float sum[GEMM_PANEL];
+                for (int j = 0; j < GEMM_PANEL; j++)
+                    sum[j] = b && j < nn ? b[n0 + j] : 0.f;
+
+                for (int kk = 0; kk < k; kk++)
+                {
+                    const float xv = x[kk];
+                    const float* wptr = panel + (size_t)kk * GEMM_PANEL;
+                    for (int j = 0; j < GEMM_PANEL; j++)
+                        sum[j] += xv * wptr[j];
+                }
+
+                for (int j = 0; j < nn; j++)
+                    y[n0 + j] = sum[j];
+                continue;
+            }
+
+            for (int i = 0; i < m; i++)
+            {
+                float* outptr = y + (size_t)i * n + n0;
+                for (int j = 0; j < nn; j++)
+                    outptr[j] = b ? b[n0 + j] : 0.f;
+            }
+
+            for (int kk = 0; kk < k; kk++)
+            {
+                const float* wptr = panel + (size_t)kk * GEMM_PANEL;
+                for (int i = 0; i < m; i++)
+                {
+                    const float xv = x[(size_t)i * k + kk];
+                    float* outptr = y + (size_t)i * n + n0;
+                    for (int j = 0; j < nn; j++)
+                        outptr[j] += xv * wptr[j];
+                }
+            }
+        }
+    });
+}
+
+// the panels when the model is prepacked, w as loaded otherwise
+static void gemm(const float* x, int m, int k, const float* w, const float* panels, const float* b, int n, float* y, ThreadPool* pool, int nt)
+{
+    if (panels)
+        gemm_panels(x, m, k, panels, b, n, y, pool, nt);
+    else
+        gemm(x, m, k, w, b, n, y, pool, nt);
+}
+
+// gelu with the tanh approximation, as exported
+static void gelu(float* x, size_t size, ThreadPool* pool, int nt)
+{
+    parallel_for(pool, nt, (int)size, 4096, [&](int i0, int i1, int) {
+        for (int i = i0; i < i1; i++)
+        {
+            float v = x[i];
+            x[i] = 0.5f * v * (1.f + tanhf(0.7978846f * (v + 0.044715f * v * v * v)));
+        }
+    });
+}
+
+#if KV_AVX2
+static inline float hsum256(__m256 x)
+{
+    __m128 x4 = _mm_add_ps(_mm256_castps256_ps128(x), _mm256_extractf128_ps(x, 1));
+    x4 = _mm_add_ps(x4, _mm_movehl_ps(x4, x4));
+    x4 = _mm_add_ss(x4, _mm_shuffle_ps(x4, x4, 1));
+    return _mm_cvtss_f32(x4);
+}
+#endif
+
+// q dot one head of a kv row, dequantized while it is loaded
+static inline float dot_head(const float* q, const unsigned char* row, int type, int h, int head_dim, int n_head)
+{
+    float sum = 0.f;
+    int d = 0;
+
+    if (type == KV_FP16)
+    {
+        const unsigned short* ptr = (const unsigned short*)row + h * head_dim;
+#if KV_AVX2
+        __m256 _sum = _mm256_setzero_ps();
+        for (; d + 8 <= head_dim; d += 8)
+            _sum = _mm256_add_ps(_sum, _mm256_mul_ps(_mm256_loadu_ps(q + d), _mm256_cvtph_ps(_mm_loadu_si128((const __m128i*)(ptr + d)))));
+        sum = hsum256(_sum);
+#elif KV_NEON
+        float32x4_t _sum = vdupq_n_f32(0.f);
+        for (; d + 4 <= head_dim; d += 4)
+            _sum = vfmaq_f32(_sum, vld1q_f32(q + d), vcvt_f32_f16(vreinterpret_f16_u16(vld1_u16(ptr + d))));
+        sum = vaddvq_f32(_sum);
+#endif
+        for (; d < head_dim; d++)
+            sum += q[d] * float16_to_float32(ptr[d]);
+        return sum;
+    }
+
+    if (type == KV_INT8)
+    {
+        // the head scale comes out of the sum
+        const float* scales = (const float*)row;
+        const signed char* ptr = (const signed char*)(row + n_head * sizeof(float)) + h * head_dim;
+#if KV_AVX2
+        __m256 _sum = _mm256_setzero_ps();
+        for (; d + 8 <= head_dim; d += 8)
+            _sum = _mm256_add_ps(_sum, _mm256_mul_ps(_mm256_loadu_ps(q + d), _mm256_cvtepi32_ps(_mm256_cvtepi8_epi32(_mm_loadl_epi64((const __m128i*)(ptr + d))))));
+        sum = hsum256(_sum);
+#elif KV_NEON
+        float32x4_t _sum = vdupq_n_f32(0.f);
+        for (; d + 8 <= head_dim; d += 8)
+        {
+            int16x8_t _p = vmovl_s8(vld1_s8(ptr + d));
+            _sum = vfmaq_f32(_sum, vld1q_f32(q + d), vcvtq_f32_s32(vmovl_s16(vget_low_s16(_p))));
+            _sum = vfmaq_f32(_sum, vld1q_f32(q + d + 4), vcvtq_f32_s32(vmovl_s16(vget_high_s16(_p))));
+        }
+        sum = vaddvq_f32(_sum);
+#endif
+        for (; d < head_dim; d++)
+            sum += q[d] * ptr[d];
+        return sum * scales[h];
+    }
+
+    const float* ptr = (const float*)row + h * head_dim;
+    for (; d < head_dim; d++)
+        sum += q[d] * ptr[d];
+    return sum;
+}
+
+// out += a * one head of a kv row
+static inline void axpy_head(float a, const unsigned char* row, int type, int h, int head_dim, int n_head, float* out)
+{
+    int d = 0;
+
+    if (type == KV_FP16)
+    {
+        const unsigned short* ptr = (const unsigned short*)row + h * head_dim;
+#if KV_AVX2
+        const __m256 _a = _mm256_set1_ps(a);
+        for (; d + 8 <= head_dim; d += 8)
+            _mm256_storeu_ps(out + d, _mm256_add_ps(_mm256_loadu_ps(out + d), _mm256_mul_ps(_a, _mm256_cvtph_ps(_mm_loadu_si128((const __m128i*)(ptr + d))))));
+#elif KV_NEON
+        for (; d + 4 <= head_dim; d += 4)
+            vst1q_f32(out + d, vfmaq_n_f32(vld1q_f32(out + d), vcvt_f32_f16(vreinterpret_f16_u16(vld1_u16(ptr + d))), a));
+#endif
+        for (; d < head_dim; d++)
+            out[d] += a * float16_to_float32(ptr[d]);
+        return;
+    }
+
+    if (type == KV_INT8)
+    {
+        const float* scales = (const float*)row;
+        const signed char* ptr = (const signed char*)(row + n_head * sizeof(float)) + h * head_dim;
+        const float as = a * scales[h];
+#if KV_AVX2
+        const __m256 _as = _mm256_set1_ps(as);
+        for (; d + 8 <= head_dim; d += 8)
+            _mm256_storeu_ps(out + d, _mm256_add_ps(_mm256_loadu_ps(out + d), _mm256_mul_ps(_as, _mm256_cvtepi32_ps(_mm256_cvtepi8_epi32(_mm_loadl_epi64((const __m128i*)(ptr + d)))))));
+#elif KV_NEON
+        for (; d + 8 <= head_dim; d += 8)
+        {
+            int16x8_t _p = vmovl_s8(vld1_s8(ptr + d));
+            vst1q_f32(out + d, vfmaq_n_f32(vld1q_f32(out + d), vcvtq_f32_s32(vmovl_s16(vget_low_s16(_p))), as));
+            vst1q_f32(out + d + 4, vfmaq_n_f32(vld1q_f32(out + d + 4), vcvtq_f32_s32(vmovl_s16(vget_high_s16(_p))), as));
+        }
+#endif
+        for (; d < head_dim; d++)
+            out[d] += as * ptr[d];
+        return;
+    }
+
+    const float* ptr = (const float*)row + h * head_dim;
+    for (; d < head_dim; d++)
+        out[d] += a * ptr[d];
+}
+
+int Model::forward(const int* ids, int n, KVCache& kv, Workspace& ws, float* logits, ThreadPool* pool) const
+{
+    BatchItem item;
+    item.ids = ids;
+    item.n = n;
+    item.kv = &kv;
+    item.logits = logits;
+    return forward(&item, 1, ws, pool);
+}
+
+int Model::forward(const BatchItem* items, int count, Workspace& ws, ThreadPool* pool) const
+{
+    int m = 0;
+    for (int b = 0; b < count; b++)
+    {
+        const BatchItem& item = items[b];
+        const int pos0 = item.kv->size();
+        if (item.n <= 0 || pos0 + item.n > std::min(cfg.n_ctx, item.kv->capacity()))
+        {
+            fprintf(stderr, "forward %d tokens at position %d exceeds the %d position context\n", item.n, pos0, cfg.n_ctx);
+            return -1;
+        }
+        for (int i = 0; i < item.n; i++)
+        {
+            if (item.ids[i] < 0 || item.ids[i] >= cfg.n_vocab)
+                return -1;
+        }
+        m += item.n;
+    }
+    if (m == 0)
+        return -1;
+
+    // nothing has been computed yet when the kv pool runs dry
+    for (int b = 0; b < count; b++)
+    {
+        if (items[b].kv->reserve(items[b].kv->size() + items[b].n) != 0)
+            return -100;
+    }
+
+    if (ws.reserve(cfg, m, pool ? pool->num_threads() : 1) != 0)
+    {
+        fprintf(stderr, "out of memory for the scratch of %d tokens\n", m);
+        return -100;
+    }
+
+    // a decode step does not get faster with every core, a prompt does
+    const int nt = num_threads_for(m, pool);
+
+    const int n_embd = cfg.n_embd;
+    const int n_head = cfg.n_head;
+    const int head_dim = n_embd / n_head;
+    const float scale = 1.f / sqrtf((float)head_dim);
+
+    float* x = ws.x;
+    float* xn = ws.xn;
+    float* qkv = ws.qkv;
+    float* attn = ws.attn;
+    float* inner = ws.inner;
+    int* row_item = ws.row_item;
+    int* row_pos = ws.row_pos;
+
+    // a model placed per numa node computes from the replica on the node of pool
+    const WeightSet* replica = replica_for(pool);
+    const BlockWeights* layers = replica ? replica->blocks.data() : blocks.data();
+    const float* token_embd = replica ? replica->wte : wte;
+    const float* pos_embd = replica ? replica->wpe : wpe;
+    const float* norm_gamma = replica ? replica->ln_f_gamma : ln_f_gamma;
+    const float* norm_beta = replica ? replica->ln_f_beta : ln_f_beta;
+    const float* head_w = replica ? replica->lm_head_w : lm_head_w;
+    const float* head_b = replica ? replica->lm_head_b : lm_head_b;
+
+    // a model that is still streaming in is waited for region by region
+    if (!wait_region(0))
+        return -1;
+
+    for (int b = 0, r = 0; b < count; b++)
+    {
+        for (int i = 0; i < items[b].n; i++, r++)
+        {
+            row_item[r] = b;
+            row_pos[r] = items[b].kv->size() + i;
+
+            const float* te = token_embd + (size_t)items[b].ids[i] * n_embd;
+            const float* pe = pos_embd + (size_t)row_pos[r] * n_embd;
+            float* outptr = x + (size_t)r * n_embd;
+            for (int j = 0; j < n_embd; j++)
+                outptr[j] = te[j] + pe[j];
+        }
+    }
+
+    for (int l = 0; l < cfg.n_layer; l++)
+    {
+        const BlockWeights& block = layers[l];
+        if (!wait_region(1 + l))
+            return -1;
+        page_in(l);
+
+        layernorm(x, m, n_embd, block.ln_1_gamma, block.ln_1_beta, cfg.eps, xn);
+        gemm(xn, m, n_embd, block.attn_w, block.attn_p, block.attn_b, n_embd * 3, qkv, pool, nt);
+
+        for (int r = 0; r < m; r++)
+        {
+            const float* k = qkv + (size_t)r * n_embd * 3 + n_embd;
+            items[row_item[r]].kv->store(l, row_pos[r], k, k + n_embd);
+        }
+
+        // causal attention, every row sees the positions of its own sequence up to itself
+        parallel_for(pool, nt, m * n_head, 1, [&](int t0, int t1, int thread) {
+            for (int t = t0; t < t1; t++)
+            {
+                const int r = t / n_head;
+                const int h = t % n_head;
+                const KVCache* kv = items[row_item[r]].kv;
+                const int len = row_pos[r] + 1;
+
+                const float* q = qkv + (size_t)r * n_embd * 3 + h * head_dim;
+                float* s = ws.scores + (size_t)thread * cfg.n_ctx;
+
+                // walk the block table, the positions of one block are contiguous
+                const int bs = kv->block_size();
+                const int type = kv->type();
+                const size_t row_bytes = kv->row_bytes();
+
+                float max = -INFINITY;
+                for (int j0 = 0; j0 < len; j0 += bs)
+                {
+                    const unsigned char* kptr = kv->key(l, j0);
+                    const int jn = std::min(bs, len - j0);
+                    for (int j = 0; j < jn; j++, kptr += row_bytes)
+                    {
+                        s[j0 + j] = dot_head(q, kptr, type, h, head_dim, n_head) * scale;
+                        max = std::max(max, s[j0 + j]);
+                    }
+                }
+
+                float denominator = 0.f;
+                for (int j = 0; j < len; j++)
+                {
+                    s[j] = expf(s[j] - max);
+                    denominator += s[j];
+                }
+
+                float* outptr = attn + (size_t)r * n_embd + h * head_dim;
+                for (int d = 0; d < head_dim; d++)
+                    outptr[d] = 0.f;
+                for (int j0 = 0; j0 < len; j0 += bs)
+                {
+                    const unsigned char* vptr = kv->value(l, j0);
+                    const int jn = std::min(bs, len - j0);
+                    for (int j = 0; j < jn; j++, vptr += row_bytes)
+                        axpy_head(s[j0 + j] / denominator, vptr, type, h, head_dim, n_head, outptr);
+                }
+            }
+        });
+
+        gemm(attn, m, n_embd, block.proj_w, block.proj_p, block.proj_b, n_embd, xn, pool, nt);
+        for (size_t j = 0; j < (size_t)m * n_embd; j++)
+            x[j] += xn[j];
+
+        layernorm(x, m, n_embd, block.ln_2_gamma, block.ln_2_beta, cfg.eps, xn);
+        gemm(xn, m, n_embd, block.fc_w, block.fc_p, block.fc_b, cfg.n_inner, inner, pool, nt);
+        gelu(inner, (size_t)m * cfg.n_inner, pool, nt);
+        gemm(inner, m, cfg.n_inner, block.mlp_proj_w, block.mlp_proj_p, block.mlp_proj_b, n_embd, xn, pool, nt);
+        for (size_t j = 0; j < (size_t)m * n_embd; j++)
+            x[j] += xn[j];
+
+        page_out(l);
+    }
+
+    if (!wait_region(cfg.n_layer + 1))
+        return -1;
+
+    // only the last token of each item is sampled from, gather those rows
+    int nlogits = 0;
+    for (int b = 0, r = 0; b < count; b++)
+    {
+        r += items[b].n;
+        items[b].kv->resize(items[b].kv->size() + items[b].n);
+
+        if (items[b].logits)
+        {
+            layernorm(x + (size_t)(r - 1) * n_embd, 1, n_embd, norm_gamma, norm_beta, cfg.eps, xn + (size_t)nlogits * n_embd);
+            row_item[nlogits++] = b;
+        }
+    }
+
+    parallel_for(pool, nt, cfg.n_vocab, 64, [&](int v0, int v1, int) {
+        for (int v = v0; v < v1; v++)
+        {
+            const float* wptr = head_w + (size_t)v * n_embd;
+            for (int i = 0; i < nlogits; i++)
+            {
+                const float* ptr = xn + (size_t)i * n_embd;
+                float sum = head_b ? head_b[v] : 0.f;
+                for (int j = 0; j < n_embd; j++)
+                    sum += ptr[j] * wptr[j];
+                items[row_item[i]].logits[v] = sum;
+            }
+        }
+    });
+
+    return 0;
+}
+
+int Model::num_threads_for(int tokens, const ThreadPool* pool) const
+{
+    const int max_threads = pool ? pool->num_threads() : 1;
+    if (threads_by_tokens.empty())
+        return max_threads;
+
+    size_t i = 0;
+    while (i + 1 < threads_by_tokens.size() && (1 << i) < tokens)
+        i++;
+    return std::min(std::max(threads_by_tokens[i], 1), max_threads);
+}
+
+int Model::calibrate(ThreadPool& pool, int max_tokens)
+{
+    if (blocks.empty())
+        return -1;
+
+    if (!wait_region(1))
+        return -1;
+
+    const BlockWeights& block = blocks[0];
+    const int n_embd = cfg.n_embd;
+    const int n_inner = cfg.n_inner;
+    max_tokens = std::max(max_tokens, 1);
+
+    std::vector<float> x((size_t)max_tokens * n_inner, 0.01f);
+    std::vector<float> y((size_t)max_tokens * n_inner);
+
+    std::vector<int> table;
+    for (int m = 1;; m = std::min(m * 2, max_tokens))
+    {
+        std::vector<double> seconds(pool.num_threads() + 1, 0.0);
+        for (int nt = 1; nt <= pool.num_threads(); nt++)
+        {
+            // the faster of two runs, the first one also warms the caches
+            for (int r = 0; r < 2; r++)
+            {
+                std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+                gemm(x.data(), m, n_embd, block.attn_w, block.attn_p, block.attn_b, n_embd * 3, y.data(), &pool, nt);
+                gemm(x.data(), m, n_embd, block.proj_w, block.proj_p, block.proj_b, n_embd, y.data(), &pool, nt);
+                gemm(x.data(), m, n_embd, block.fc_w, block.fc_p, block.fc_b, n_inner, y.data(), &pool, nt);
+                gemm(x.data(), m, n_inner, block.mlp_proj_w, block.mlp_proj_p, block.mlp_proj_b, n_embd, y.data(), &pool, nt);
+                double t = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+                seconds[nt] = r == 0 ? t : std::min(seconds[nt], t);
+            }
+        }
+
+        const double fastest = *std::min_element(seconds.begin() + 1, seconds.end());
+        int nt = 1;
+        while (seconds[nt] > fastest * 1.1)
+            nt++;
+        table.push_back(nt);
+
+        if (m == max_tokens)
+            break;
+    }
+
+    threads_by_tokens = table;
+
+    fprintf(stderr, "threads by tokens");
+    for (size_t i = 0; i < table.size(); i++)
+        fprintf(stderr, " %d:%d", std::min(1 << i, max_tokens), table[i]);
+    fprintf(stderr, "\n");
+
+    return 0;
+}
+
+int Model::region_tensors(int region, const float** data, size_t* count) const
+{
+    const size_t n_embd = cfg.n_embd;
+    const size_t n_inner = cfg.n_inner;
+
+    int n = 0;
+    if (region == 0)
+    {
+        data[n] = wte;
+        count[n++] = cfg.n_vocab * n_embd;
+        data[n] = wpe;
+        count[n++] = cfg.n_ctx * n_embd;
+    }
+    else if (region <= cfg.n_layer)
+    {
+        const BlockWeights& block = blocks[region - 1];
+        const float* tensors[12] = {block.ln_1_gamma, block.ln_1_beta, block.attn_w, block.attn_b, block.proj_w, block.proj_b, block.ln_2_gamma, block.ln_2_beta, block.fc_w, block.fc_b, block.mlp_proj_w, block.mlp_proj_b};
+        const size_t sizes[12] = {n_embd, n_embd, n_embd * n_embd * 3, n_embd * 3, n_embd * n_embd, n_embd, n_embd, n_embd, n_embd * n_inner, n_inner, n_inner * n_embd, n_embd};
+        for (int i = 0; i < 12; i++)
+        {
+            data[n] = tensors[i];
+            count[n++] = sizes[i];
+        }
+
+        // a prepacked block is computed from its panels, the loaded gemm weights are never read again
+        if (block.attn_p)
+        {
+            const float* panels[4] = {block.attn_p, block.proj_p, block.fc_p, block.mlp_proj_p};
+            const size_t widths[4] = {n_embd * 3, n_embd, n_inner, n_embd};
+            const int slots[4] = {2, 4, 8, 10};
+            for (int j = 0; j < 4; j++)
+            {
+                data[slots[j]] = panels[j];
+                count[slots[j]] = sizes[slots[j]] / widths[j] * ((widths[j] + GEMM_PANEL - 1) / GEMM_PANEL * GEMM_PANEL);
+            }
+        }
+    }
+    else
+    {
+        data[n] = ln_f_gamma;
+        count[n++] = n_embd;
+        data[n] = ln_f_beta;
+        count[n++] = n_embd;
+        data[n] = lm_head_w;
+        count[n++] = cfg.n_vocab * n_embd;
+        if (lm_head_b)
+        {
+            data[n] = lm_head_b;
+            count[n++] = cfg.n_vocab;
+        }
+    }
+    return n;
+}
+
+int Model::weight_checksums(std::vector<unsigned int>& crcs) const
+{
+    crcs.clear();
+    if (blocks.empty())
+        return -1;
+
+    for (int r = 0; r < region_count(); r++)
+    {
+        const float* data[12];
+        size_t count[12];
+        const int n = region_tensors(r, data, count);
+
+        unsigned int crc = 0;
+        for (int i = 0; i < n; i++)
+            crc = crc32((const unsigned char*)data[i], count[i] * sizeof(float), crc);
+        crcs.push_back(crc);
+    }
+    return 0;
+}
+
+const char* Model::isa()
+{
+    return GEMM_ISA;
+}
+
+int Model::panel_width()
+{
+    return GEMM_PANEL;
+}
+
+unsigned int Model::model_hash() const
+{
+    unsigned int crc = crc32((const unsigned char*)&cfg, sizeof(cfg));
+    if (!region_crcs.empty())
+        return crc32((const unsigned char*)region_crcs.data(), region_crcs.size() * sizeof(unsigned int), crc);
+
+    // a loose bin has no checksums, hashing it whole would cost more than packing, 64 bytes of every megabyte
+    // and the tail of every tensor tell one model from another in a few hundred pages
+    for (size_t i = 0; i < tensors.size(); i++)
+    {
+        const unsigned char* ptr = (const unsigned char*)tensors[i].first;
+        const unsigned long long size = tensors[i].second * sizeof(float);
+        crc = crc32((const unsigned char*)&size, sizeof(size), crc);
+        for (size_t j = 0; j < size; j += 1048576)
+            crc = crc32(ptr + j, std::min((size_t)size - j, (size_t)64), crc);
+        crc = crc32(ptr + size - std::min(size, 64ull), (size_t)std::min(size, 64ull), crc);
+    }
+    return crc;
+}
+
+// k x n of the four gemms of a block
+static void gemm_shape(const ModelConfig& cfg, int j, int* k, int* n)
+{
+    const int shapes[4][2] = {
+        {cfg.n_embd, cfg.n_embd * 3},
+        {cfg.n_embd, cfg.n_embd},
+        {cfg.n_embd, cfg.n_inner},
+        {cfg.n_inner, cfg.n_embd},
+    };
+    *k = shapes[j][0];
+    *n = shapes[j][1];
+}
+
+// w is k x n row major, panel p row kk goes to panels + (p * k + kk) * GEMM_PANEL, the last panel is zero padded
+static void pack_panels(const float* w, int k, int n, float* panels)
+{
+    for (int n0 = 0, p = 0; n0 < n; n0 += GEMM_PANEL, p++)
+    {
+        const int nn = std::min(GEMM_PANEL, n - n0);
+        for (int kk = 0; kk < k; kk++)
+        {
+            float* outptr = panels + ((size_t)p * k + kk) * GEMM_PANEL;
+            memcpy(outptr, w + (size_t)kk * n + n0, nn * sizeof(float));
+            for (int j = nn; j < GEMM_PANEL; j++)
+                outptr[j] = 0.f;
+        }
+    }
+}
+
+size_t Model::panel_layout(std::vector<size_t>& offsets) const
+{
+    offsets.clear();
+    size_t size = 0;
+    for (int l = 0; l < cfg.n_layer; l++)
+    {
+        for (int j = 0; j < 4; j++)
+        {
+            int k, n;
+            gemm_shape(cfg, j, &k, &n);
+            offsets.push_back(size);
+            size += ((size_t)(n + GEMM_PANEL - 1) / GEMM_PANEL * GEMM_PANEL * k * sizeof(float) + 63) & ~(size_t)63;
+        }
+    }
+    return size;
+}
+
+void Model::bind_panels(const unsigned char* panels, const std::vector<size_t>& offsets)
+{
+    for (int l = 0; l < cfg.n_layer; l++)
+    {
+        BlockWeights& block = blocks[l];
+        block.attn_p = (const float*)(panels + offsets[l * 4 + 0]);
+        block.proj_p = (const float*)(panels + offsets[l * 4 + 1]);
+        block.fc_p = (const float*)(panels + offsets[l * 4 + 2]);
+        block.mlp_proj_p = (const float*)(panels + offsets[l * 4 + 3]);
+    }
+}
+
+int Model::map_panels(const char* cachepath, unsigned int hash)
+{
+    if (panels_cache.open(cachepath) != 0)
+        return -1;
+
+    std::vector<size_t> offsets;
+    const size_t size = panel_layout(offsets);
+
+    size_t key_size = 0;
+    size_t checksums_size = 0;
+    size_t panels_size = 0;
+    const unsigned char* key = panels_cache.section(SECTION_PREPACK, &key_size);
+    const unsigned char* checksums = panels_cache.section(SECTION_CHECKSUMS, &checksums_size);
+    const unsigned char* panels = panels_cache.section(SECTION_PANELS, &panels_size);
+
+    PrepackKey cached;
+    memset(&cached, 0, sizeof(cached));
+    if (key && key_size == sizeof(cached))
+        memcpy(&cached, key, sizeof(cached));
+
+    if (cached.model_hash != hash || cached.panel_width != GEMM_PANEL || strncmp(cached.isa, GEMM_ISA, sizeof(cached.isa)) != 0
+            || !checksums || checksums_size != (size_t)region_count() * sizeof(unsigned int) || !panels || panels_size != size)
+    {
+        fprintf(stderr, "prepack cache %s is for another model or isa, packing again\n", cachepath);
+        panels_cache.close();
+        return -1;
+    }
+
+    bind_panels(panels, offsets);
+
+    // the panels are verified region by region while streaming like the weights of a package
+    region_crcs.resize(region_count());
+    memcpy(region_crcs.data(), checksums, checksums_size);
+
+    return 0;
+}
+
+int Model::prepack(const char* cachepath)
+{
+    stop_streaming();
+    if (blocks.empty())
+        return -1;
+    if (blocks[0].attn_p)
+        return 0;
+
+    const unsigned int hash = model_hash();
+    if (cachepath && map_panels(cachepath, hash) == 0)
+        return 0;
+
+    // the panels get checksums of their own, the weights they are packed from have to pass the loaded ones first
+    std::vector<unsigned int> crcs;
+    if (!region_crcs.empty())
+    {
+        weight_checksums(crcs);
+        for (int r = 0; r < region_count(); r++)
+        {
+            if (crcs[r] != region_crcs[r])
+            {
+                fprintf(stderr, "gpt2 weights region %d checksum mismatch\n", r);
+                return -1;
+            }
+        }
+    }
+
+    std::vector<size_t> offsets;
+    const size_t size = panel_layout(offsets);
+    panels_blob.resize(size);
+    for (int l = 0; l < cfg.n_layer; l++)
+    {
+        const BlockWeights& block = blocks[l];
+        const float* weights[4] = {block.attn_w, block.proj_w, block.fc_w, block.mlp_proj_w};
+        for (int j = 0; j < 4; j++)
+        {
+            int k, n;
+            gemm_shape(cfg, j, &k, &n);
+            pack_panels(weights[j], k, n, (float*)(panels_blob.data() + offsets[l * 4 + j]));
+        }
+    }
+    bind_panels(panels_blob.data(), offsets);
+
+    // checksums of the regions as they are computed from now on, the loaded ones no longer apply to the blocks
+    weight_checksums(crcs);
+    region_crcs = crcs;
+
+    if (!cachepath)
+        return 0;
+
+    PrepackKey key;
+    memset(&key, 0, sizeof(key));
+    key.model_hash = hash;
+    key.panel_width = GEMM_PANEL;
+    strncpy(key.isa, GEMM_ISA, sizeof(key.isa) - 1);
+
+    PackageInput sections[3] = {
+        {SECTION_PREPACK, &key, sizeof(key)},
+        {SECTION_CHECKSUMS, crcs.data(), crcs.size() * sizeof(unsigned int)},
+        {SECTION_PANELS, panels_blob.data(), panels_blob.size()},
+    };
+
+    // written aside and renamed over, a start that dies halfway leaves no torn cache behind
+    const std::string tmppath = std::string(cachepath) + ".tmp";
+    if (Package::write(tmppath.c_str(), sections, 3) != 0)
+    {
+        remove(tmppath.c_str());
+        return 0;
+    }
+    remove(cachepath);
+    if (rename(tmppath.c_str(), cachepath) != 0)
+    {
+        fprintf(stderr, "rename %s failed\n", tmppath.c_str());
+        remove(tmppath.c_str());
+        return 0;
+    }
+
+    // the mapped cache stands in for the packed copy, its pages are clean and can be dropped under pressure
+    if (map_panels(cachepath, hash) == 0)
+        std::vector<unsigned char>().swap(panels_blob);
+
+    fprintf(stderr, "prepacked %.1f MB of %s panels into %s\n", size / 1048576.0, GEMM_ISA, cachepath);
+
+    return 0;
+}
+
+int Model::stream(int num_threads)
+{
+    stop_streaming();
+    if (blocks.empty())
+        return -1;
+
+    // placed weights are in memory and verified already
+    if (!replicas.empty())
+        return 0;
+
+    {
+        std::lock_guard<std::mutex> g(ready_lock);
+        region_state.assign(region_count(), 0);
+        all_ready = false;
+    }
+    next_region = 0;
+    stop_loading = false;
+
+    for (int i = 0; i < std::max(num_threads, 1); i++)
+        loaders.push_back(std::thread(&Model::load_regions, this));
+    return 0;
+}
+
+void Model::load_regions()
+{
+    // regions are claimed in forward order, the first blocks are in before the last ones are read
+    for (;;)
+    {
+        const int region = next_region.fetch_add(1);
+        if (region >= region_count() || stop_loading)
+            break;
+
+        const float* data[12];
+        size_t count[12];
+        const int n = region_tensors(region, data, count);
+
+        // the checksum reads every byte and so pages the region in, without one a byte per page does
+        bool ok = true;
+        if (!region_crcs.empty())
+        {
+            unsigned int crc = 0;
+            for (int i = 0; i < n; i++)
+                crc = crc32((const unsigned char*)data[i], count[i] * sizeof(float), crc);
+            ok = crc == region_crcs[region];
+            if (!ok)
+                fprintf(stderr, "gpt2 weights region %d checksum mismatch\n", region);
+        }
+        else
+        {
+            touch_region(region);
+        }
+
+        // a block that streams in low memory mode is only checked now, the first forward reads it again
+        if (paging() && region >= 1 + paged_from && region <= cfg.n_layer)
+            advise_region(region, ADVICE_DONTNEED);
+
+        {
+            std::lock_guard<std::mutex> g(ready_lock);
+            region_state[region] = ok ? 1 : -1;
+            if (std::count(region_state.begin(), region_state.end(), 1) == (int)region_state.size())
+                all_ready = true;
+        }
+        ready_cond.notify_all();
+    }
+}
+
+void Model::touch_region(int region) const
+{
+    const float* data[12];
+    size_t count[12];
+    const int n = region_tensors(region, data, count);
+
+    unsigned int sum = 0;
+    for (int i = 0; i < n; i++)
+    {
+        const volatile unsigned char* ptr = (const volatile unsigned char*)data[i];
+        const size_t size = count[i] * sizeof(float);
+        for (size_t j = 0; j < size; j += 4096)
+            sum += ptr[j];
+    }
+    (void)sum;
+}
+
+const MappedFile* Model::mapping_of(const void* data, size_t size) const
+{
+    if (weights_file.contains(data, size))
+        return &weights_file;
+    if (package_file && package_file->contains(data, size))
+        return package_file;
+    if (panels_cache.mapping().contains(data, size))
+        return &panels_cache.mapping();
+    return 0;
+}
+
+void Model::advise_region(int region, int advice) const
+{
+    const float* data[12];
+    size_t count[12];
+    const int n = region_tensors(region, data, count);
+    for (int i = 0; i < n; i++)
+    {
+        const MappedFile* file = mapping_of(data[i], count[i] * sizeof(float));
+        if (file)
+            file->advise(data[i], count[i] * sizeof(float), advice);
+    }
+}
+
+bool Model::region_resident(int region) const
+{
+    const float* data[12];
+    size_t count[12];
+    const int n = region_tensors(region, data, count);
+    for (int i = 0; i < n; i++)
+    {
+        const MappedFile* file = mapping_of(data[i], count[i] * sizeof(float));
+        if (file && !file->resident(data[i], count[i] * sizeof(float)))
+            return false;
+    }
+    return true;
+}
+
+int Model::set_memory_budget(size_t bytes)
+{
+    if (blocks.empty())
+        return -1;
+
+    size_t fixed = 0;
+    size_t block = 0;
+    for (int r = 0; r < region_count(); r++)
+    {
+        const float* data[12];
+        size_t count[12];
+        const int n = region_tensors(r, data, count);
+
+        size_t size = 0;
+        for (int i = 0; i < n; i++)
+            size += count[i] * sizeof(float);
+        if (r == 0 || r == region_count() - 1)
+            fixed += size;
+        else
+            block = std::max(block, size);
+    }
+
+    memory_budget = bytes;
+    paged_from = cfg.n_layer;
+    if (bytes != 0 && bytes < fixed + block * cfg.n_layer)
+    {
+        // two blocks are the floor, the one computing and the one read ahead
+        const int resident = (int)std::max(bytes > fixed ? (bytes - fixed) / block : 0, (size_t)2);
+        paged_from = std::min(resident, cfg.n_layer) - 2;
+        if (bytes < fixed + block * 2)
+            fprintf(stderr, "memory budget %.1f MB is below the %.1f MB of the head and two blocks\n", bytes / 1048576.0, (fixed + block * 2) / 1048576.0);
+    }
+    stall_count = 0;
+    stall_us = 0;
+
+    // the streamed blocks leave right away, they come back one at a time
+    for (int l = paged_from; l < cfg.n_layer; l++)
+        advise_region(1 + l, ADVICE_DONTNEED);
+
+    // a prepacked model never reads the loaded gemm weights again, whatever of them got mapped leaves too
+    for (int l = 0; bytes != 0 && l < cfg.n_layer && blocks[l].attn_p; l++)
+    {
+        const BlockWeights& b = blocks[l];
+        const float* weights[4] = {b.attn_w, b.proj_w, b.fc_w, b.mlp_proj_w};
+        for (int j = 0; j < 4; j++)
+        {
+            int k, n;
+            gemm_shape(cfg, j, &k, &n);
+            const MappedFile* file = mapping_of(weights[j], (size_t)k * n * sizeof(float));
+            if (file)
+                file->advise(weights[j], (size_t)k * n * sizeof(float), ADVICE_DONTNEED);
+        }
+    }
+
+    fprintf(stderr, "memory budget %.1f MB keeps %d of %d blocks resident\n", bytes / 1048576.0, paging_stats().resident_blocks, cfg.n_layer);
+
+    return 0;
+}
+
+PagingStats Model::paging_stats() const
+{
+    PagingStats stats;
+    stats.resident_blocks = paging() ? paged_from + 2 : cfg.n_layer;
+    stats.stalls = stall_count;
+    stats.stall_seconds = stall_us / 1e6;
+    return stats;
+}
+
+void Model::page_in(int layer) const
+{
+    if (!paging())
+        return;
+
+    // a block still in the page cache is only mapped back on the way, one that was evicted or is still
+    // being read ahead is waited for here, before its gemms, so that the wait can be told apart
+    if (layer >= paged_from && !region_resident(1 + layer))
+    {
+        std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+        touch_region(1 + layer);
+        stall_us += std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - t0).count();
+        stall_count++;
+    }
+
+    // the storage reads the next block while this one computes, after the last block the next forward starts over
+    const int next = (layer + 1) % cfg.n_layer;
+    if (next >= paged_from)
+        advise_region(1 + next, ADVICE_WILLNEED);
+}
+
+void Model::page_out(int layer) const
+{
+    if (paging() && layer >= paged_from)
+        advise_region(1 + layer, ADVICE_DONTNEED);
+}
+
+// anonymous memory for a placed copy of the weights, 2 MB aligned so that huge pages can back all of it
+static unsigned char* alloc_pages(size_t size, bool huge_pages)
+{
+#ifdef _WIN32
+    (void)huge_pages;
+    return (unsigned char*)_aligned_malloc(size, 2 * 1024 * 1024);
+#else
+    void* ptr = 0;
+    if (posix_memalign(&ptr, 2 * 1024 * 1024, size) != 0)
+        return 0;
+#ifdef MADV_HUGEPAGE
+    if (huge_pages)
+        madvise(ptr, size, MADV_HUGEPAGE);
+#endif
+    return (unsigned char*)ptr;
+#endif
+}
+
+static void free_pages(unsigned char* ptr)
+{
+#ifdef _WIN32
+    _aligned_free(ptr);
+#else
+    free(ptr);
+#endif
+}
+
+int Model::place(int flags)
+{
+    stop_streaming();
+    release_replicas();
+    if (blocks.empty())
+        return -1;
+    if (flags == 0)
+        return 0;
+
+    // every tensor a forward reads once, a tied head shares the copy of the embeddings
+    std::vector<std::pair<const float*, size_t> > sources;
+    std::map<const float*, size_t> offsets;
+    size_t size = 0;
+    for (int r = 0; r < region_count(); r++)
+    {
+        const float* data[12];
+        size_t count[12];
+        const int n = region_tensors(r, data, count);
+
+        unsigned int crc = 0;
+        for (int i = 0; i < n; i++)
+        {
+            if (!region_crcs.empty())
+                crc = crc32((const unsigned char*)data[i], count[i] * sizeof(float), crc);
+            if (offsets.count(data[i]))
+                continue;
+            offsets[data[i]] = size;
+            sources.push_back(std::make_pair(data[i], count[i]));
+            size = (size + count[i] * sizeof(float) + 63) & ~(size_t)63;
+        }
+
+        if (!region_crcs.empty() && crc != region_crcs[r])
+        {
+            fprintf(stderr, "gpt2 weights region %d checksum mismatch\n", r);
+            return -1;
+        }
+    }
+    size = (size + 2 * 1024 * 1024 - 1) & ~(size_t)(2 * 1024 * 1024 - 1);
+
+    std::vector<std::vector<int> > nodes(1);
+    if (flags & PLACE_NUMA_REPLICAS)
+        nodes = get_numa_nodes();
+
+    for (size_t i = 0; i < nodes.size(); i++)
+    {
+        // allocated and written on the node, the calling thread keeps its own affinity
+        unsigned char* memory = 0;
+        std::thread copier([&]() {
+            if (!nodes[i].empty())
+                set_thread_affinity(nodes[i]);
+            memory = alloc_pages(size, (flags & PLACE_HUGE_PAGES) != 0);
+            if (!memory)
+                return;
+            for (size_t j = 0; j < sources.size(); j++)
+                memcpy(memory + offsets[sources[j].first], sources[j].first, sources[j].second * sizeof(float));
+        });
+        copier.join();
+
+        if (!memory)
+        {
+            fprintf(stderr, "out of memory for %.1f MB of placed weights\n", size / 1048576.0);
+            release_replicas();
+            return -100;
+        }
+
+        // the pointers of the loaded weights moved into the copy, the unused loaded gemm weights stay where they are
+        auto moved = [&](const float* p) -> const float* {
+            std::map<const float*, size_t>::const_iterator it = offsets.find(p);
+            return it == offsets.end() ? p : (const float*)(memory + it->second);
+        };
+
+        WeightSet replica;
+        replica.memory = memory;
+        replica.wte = moved(wte);
+        replica.wpe = moved(wpe);
+        replica.ln_f_gamma = moved(ln_f_gamma);
+        replica.ln_f_beta = moved(ln_f_beta);
+        replica.lm_head_w = moved(lm_head_w);
+        replica.lm_head_b = lm_head_b ? moved(lm_head_b) : 0;
+        replica.blocks = blocks;
+        for (int l = 0; l < cfg.n_layer; l++)
+        {
+            BlockWeights& block = replica.blocks[l];
+            const float** fields[16] = {&block.ln_1_gamma, &block.ln_1_beta, &block.attn_w, &block.attn_b, &block.proj_w, &block.proj_b, &block.ln_2_gamma, &block.ln_2_beta, &block.fc_w, &block.fc_b, &block.mlp_proj_w, &block.mlp_proj_b, &block.attn_p, &block.proj_p, &block.fc_p, &block.mlp_proj_p};
+            for (int j = 0; j < 16; j++)
+            {
+                if (*fields[j])
+                    *fields[j] = moved(*fields[j]);
+            }
+        }
+        replicas.push_back(replica);
+    }
+
+    fprintf(stderr, "placed %.1f MB of weights %d times%s\n", size / 1048576.0, (int)replicas.size(), flags & PLACE_HUGE_PAGES ? " on huge pages" : "");
+
+    return 0;
+}
+
+void Model::release_replicas()
+{
+    for (size_t i = 0; i < replicas.size(); i++)
+        free_pages(replicas[i].memory);
+    replicas.clear();
+}
+
+const Model::WeightSet* Model::replica_for(const ThreadPool* pool) const
+{
+    if (replicas.empty())
+        return 0;
+    if (pool && pool->numa_node >= 0 && pool->numa_node < (int)replicas.size())
+        return &replicas[pool->numa_node];
+    return &replicas[0];
+}
+
+bool Model::wait_region(int region) const
+{
+    if (all_ready.load(std::memory_order_acquire))
+        return true;
+
+    std::unique_lock<std::mutex> g(ready_lock);
+    ready_cond.wait(g, [&] { return region_state[region] != 0; });
+    return region_state[region] == 1;
+}
+
+int Model::wait_loaded() const
+{
+    for (int r = 0; r < region_count(); r++)
+    {
+        if (!wait_region(r))
+            return -1;
+    }
+    return 0;
+}
+
+void Model::stop_streaming()
+{
+    stop_loading = true;
+    for (size_t i = 0; i < loaders.size(); i++)
+        loaders[i].join();
+    loaders.clear();
+
+    // a region nobody got to is paged in by its first forward instead, a failed one stays failed
+    std::lock_guard<std::mutex> g(ready_lock);
+    for (size_t i = 0; i < region_state.size(); i++)
+    {
+        if (region_state[i] == 0)
+            region_state[i] = 1;
+    }
+    all_ready = std::count(region_state.begin(), region_state.end(), 1) == (int)region_state.size();
+}
@@ -0,0 +1,314 @@
+#ifndef MODEL_H
+#define MODEL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <stddef.h>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "arena.h"
+#include "mappedfile.h"
+#include "package.h"
+
+class KVCache;
+class ThreadPool;
+
+// hyper parameters, read from the shapes in gpt2.param
+struct ModelConfig
+{
+    int n_layer;
+    int n_head;
+    int n_embd;
+    int n_inner;
+    int n_vocab;
+    int n_ctx;
+    float eps;
+};
+
+// weights of one transformer block, gemm weights are Conv1D layout, in x out row major
+struct BlockWeights
+{
+    const float* ln_1_gamma;
+    const float* ln_1_beta;
+    const float* attn_w; // n_embd x 3 n_embd, q k v
+    const float* attn_b;
+    const float* proj_w; // n_embd x n_embd
+    const float* proj_b;
+    const float* ln_2_gamma;
+    const float* ln_2_beta;
+    const float* fc_w; // n_embd x n_inner
+    const float* fc_b;
+    const float* mlp_proj_w; // n_inner x n_embd
+    const float* mlp_proj_b;
+
+    // the four gemm weights reordered into column panels by Model::prepack, null until then
+    const float* attn_p;
+    const float* proj_p;
+    const float* fc_p;
+    const float* mlp_proj_p;
+};
+
+// where Model::place puts the weights
+enum WeightPlacement
+{
+    PLACE_HUGE_PAGES = 1,   // 2 MB transparent huge pages, fewer tlb misses over the gemms and the lm head
+    PLACE_NUMA_REPLICAS = 2 // one copy on every numa node, a pool reads the copy of its ThreadPool::numa_node
+};
+
+// what the low memory mode cost so far, see Model::set_memory_budget
+struct PagingStats
+{
+    // blocks kept in memory, the others are dropped after use and read again on the next forward
+    int resident_blocks;
+    // streamed blocks a forward found outside the page cache and had to wait for
+    long long stalls;
+    double stall_seconds;
+};
+
+// one sequence of a batched forward
+struct BatchItem
+{
+    // tokens to run, they follow the kv->size() cached positions
+    const int* ids;
+    int n;
+    KVCache* kv;
+    // n_vocab floats for the last token, may be null
+    float* logits;
+};
+
+// the steps of a forward a scratch buffer can be live in, attention and mlp repeat per block
+enum WorkspacePhase
+{
+    PHASE_EMBED = 0,
+    PHASE_ATTENTION = 1,
+    PHASE_MLP = 2,
+    PHASE_HEAD = 3,
+    PHASE_COUNT = 4
+};
+
+// scratch of one forward call, owned by the caller so that the model itself stays const
+// the buffers are planned into one slab by liveness, the qkv, attention and score buffers of a block
+// share their memory with the mlp buffer, the slab only grows when a forward of more tokens comes
+class Workspace
+{
+public:
+    Workspace();
+
+    // plan and place the buffers for n tokens at once, -100 if the slab cannot grow
+    // reserving the largest forward up front keeps the allocator out of inference
+    int reserve(const ModelConfig& config, int n, int num_threads);
+
+    // the plan of the last reserve, bytes live in each phase and the slab that holds them
+    const SlabBuffer* buffers() const { return plan; }
+    int buffer_count() const { return WORKSPACE_BUFFERS; }
+    size_t phase_bytes(int phase) const;
+    size_t slab_bytes() const { return slab; }
+    size_t capacity() const { return arena.capacity(); }
+
+public:
+    float* x;
+    float* xn;
+    float* qkv;
+    float* attn;
+    float* inner;
+    // one attention score row per thread
+    float* scores;
+    // batch item and position of every token row
+    int* row_item;
+    int* row_pos;
+
+private:
+    Workspace(const Workspace&);
+    Workspace& operator=(const Workspace&);
+
+    enum
+    {
+        WORKSPACE_BUFFERS = 8
+    };
+
+private:
+    Arena arena;
+    SlabBuffer plan[WORKSPACE_BUFFERS];
+    size_t slab;
+};
+
+// gpt2 decoder with a kv cache, computed natively instead of through the ncnn graph
+// the graph recomputes every position on every step, here each token is computed once
+// weights are immutable after load, forward is const and may run from many threads at once
+class Model
+{
+public:
+    Model();
+    ~Model();
+
+    // gpt2.param is only used for the layer order and the shapes, the math is fixed
+    // gpt2.bin is memory mapped and the weights point into the mapping, nothing is read until it is used
+    int load(const char* parampath, const char* binpath);
+#if __ANDROID_API__ >= 9
+    // uncompressed assets are mapped from the apk the same way
+    int load(AAssetManager* mgr, const char* parampath, const char* binpath);
+#endif
+    // the bin is copied, the caller may free it afterwards
+    int load(const char* param, size_t param_size, const unsigned char* bin, size_t bin_size);
+    // param and weights of a single file package, used in place, the package must outlive the model
+    int load(const Package& package);
+
+    // the loaded weights as the weights section of a package, every tensor 64 byte aligned
+    int pack_weights(std::vector<unsigned char>& weights) const;
+    // one crc32 per region, the checksums section of a package
+    int weight_checksums(std::vector<unsigned int>& crcs) const;
+
+    // reorder every gemm weight into panels of panel_width() columns, each panel contiguous over all rows,
+    // a decode step keeps one panel of outputs in registers and every thread streams one run of memory
+    // the panels are cached in cachepath, keyed by the model hash and the isa of this build, later starts
+    // map the cache instead of packing again, a stale or corrupt cache is packed and written over
+    // cachepath may be null to pack in memory only, call after load and before stream
+    // weights that fail the checksums they were loaded with are not packed, -1 and nothing is cached
+    int prepack(const char* cachepath);
+
+    // simd the kernels of this build were compiled for, "avx512", "avx2", "neon" or "generic"
+    static const char* isa();
+    static int panel_width();
+
+    // low memory mode, keeps the weights resident in this process under bytes, 0 turns it off
+    // the embeddings and the head always stay, then as many blocks as fit, from the first one on, at least two
+    // the other blocks stream through two slots, each one is dropped from the mapping once computed
+    // and the next one is read ahead while the current one computes, the last one reads the first one ahead
+    // only weights mapped from a file can be dropped, a copy in memory stays whole
+    // call after load and prepack and before stream, a forward is slower but the process stays small
+    int set_memory_budget(size_t bytes);
+    PagingStats paging_stats() const;
+
+    // copy the weights a forward reads out of the mapping into anonymous memory, placed as flags asks
+    // each numa replica is written by a thread pinned to that node, so its pages land there on first touch
+    // a forward then reads the replica of the node its pool is bound to, every pool should stay on the cpus of one node
+    // the copies are verified against the region checksums, they replace streaming and cannot be paged out
+    // call after load and prepack, 0 flags goes back to the mapping
+    int place(int flags);
+
+    // page the weights in on num_threads background threads, the embeddings first, then block by block
+    // forward can start right away, it only waits for the regions it reaches before they are in
+    // a package with checksums has every region verified on the way, a forward that needs a corrupt one fails
+    int stream(int num_threads);
+    // join the background threads, the regions they did not reach page in on first use
+    void stop_streaming();
+    // every region is in, -1 if one failed its checksum
+    int wait_loaded() const;
+
+    const ModelConfig& config() const { return cfg; }
+
+    // run n tokens following the kv.size() cached ones and append their keys and values to kv
+    // logits of the last token are written to logits (n_vocab floats) unless it is null
+    // kernels run on the threads of pool, or on the calling thread alone if it is null
+    int forward(const int* ids, int n, KVCache& kv, Workspace& ws, float* logits, ThreadPool* pool) const;
+
+    // several independent sequences in one pass, every weight matrix is streamed once for all of them
+    // the tokens of all items are stacked into one gemm, attention stays per item, every item has its own kv
+    int forward(const BatchItem* items, int count, Workspace& ws, ThreadPool* pool) const;
+
+    // time the gemms of one block for 1, 2, 4 ... max_tokens tokens on 1 to all threads of pool and keep,
+    // per token count, the fewest threads within a tenth of the fastest
+    // decode is bound by memory bandwidth and saturates on a few cores, the others stay free for other sessions
+    // call before the model is shared, takes a fraction of a second
+    int calibrate(ThreadPool& pool, int max_tokens = 64);
+
+    // entry i is the thread count for forwards of up to 2^i tokens, the last entry for any more
+    // empty uses every thread of the pool, the table can be saved and restored instead of calibrating again
+    const std::vector<int>& thread_table() const { return threads_by_tokens; }
+    void set_thread_table(const std::vector<int>& table) { threads_by_tokens = table; }
+    int num_threads_for(int tokens, const ThreadPool* pool) const;
+
+private:
+    Model(const Model&);
+    Model& operator=(const Model&);
+
+    int load_mapped(const char* param, size_t param_size);
+    // point the weights into bin, which has to outlive them
+    // packed is the flagless 64 byte aligned layout of a package
+    int bind(const char* param, size_t param_size, const unsigned char* bin, size_t bin_size, bool packed);
+
+    // region 0 is the embeddings, 1 to n_layer the blocks, n_layer + 1 the head, at most 12 tensors each
+    int region_count() const { return cfg.n_layer + 2; }
+    int region_tensors(int region, const float** data, size_t* count) const;
+    // crc of the config and the region checksums, the weights are sampled when there are none
+    unsigned int model_hash() const;
+    // offset of every gemm in the panels, in block order, returns their total size in bytes
+    size_t panel_layout(std::vector<size_t>& offsets) const;
+    void bind_panels(const unsigned char* panels, const std::vector<size_t>& offsets);
+    int map_panels(const char* cachepath, unsigned int hash);
+    void touch_region(int region) const;
+    // madvise a region through the file it is mapped from
+    void advise_region(int region, int advice) const;
+    bool region_resident(int region) const;
+    const MappedFile* mapping_of(const void* data, size_t size) const;
+    // around every block of a forward in low memory mode
+    bool paging() const { return memory_budget != 0 && paged_from < cfg.n_layer && replicas.empty(); }
+    void page_in(int layer) const;
+    void page_out(int layer) const;
+    void load_regions();
+    void release_replicas();
+    bool wait_region(int region) const;
+
+private:
+    ModelConfig cfg;
+
+    const float* wte; // n_vocab x n_embd
+    const float* wpe; // n_ctx x n_embd
+    std::vector<BlockWeights> blocks;
+    const float* ln_f_gamma;
+    const float* ln_f_beta;
+    const float* lm_head_w; // n_vocab x n_embd
+    const float* lm_head_b;
+
+    std::vector<int> threads_by_tokens;
+
+    // every tensor in load order
+    std::vector<std::pair<const float*, size_t> > tensors;
+
+    // streaming load, region_state is 0 while loading, 1 ready, -1 corrupt
+    std::vector<unsigned int> region_crcs;
+    std::vector<int> region_state;
+    std::atomic<bool> all_ready;
+    std::atomic<int> next_region;
+    std::atomic<bool> stop_loading;
+    std::vector<std::thread> loaders;
+    mutable std::mutex ready_lock;
+    mutable std::condition_variable ready_cond;
+
+    // low memory mode, blocks from paged_from on stream, n_layer when everything stays
+    size_t memory_budget;
+    int paged_from;
+    mutable std::atomic<long long> stall_count;
+    mutable std::atomic<long long> stall_us;
+
+    // backing storage of the weights, the mapped bin, the mapping of the package or a copy
+    MappedFile weights_file;
+    const MappedFile* package_file;
+    std::vector<unsigned char> blob;
+
+    // the pointers a forward reads in one placed copy of the weights
+    struct WeightSet
+    {
+        const float* wte;
+        const float* wpe;
+        std::vector<BlockWeights> blocks;
+        const float* ln_f_gamma;
+        const float* ln_f_beta;
+        const float* lm_head_w;
+        const float* lm_head_b;
+        unsigned char* memory;
+    };
+    const WeightSet* replica_for(const ThreadPool* pool) const;
+
+    // placed copies, one per numa node or a single one, none when the weights are read from where they were loaded
+    std::vector<WeightSet> replicas;
+
+    // backing storage of the panels, the mapped prepack cache or packed in memory
+    Package panels_cache;
+    std::vector<unsigned char> panels_blob;
+};
+
+#endif // MODEL_H
@@ -0,0 +1,204 @@
+#include "package.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+
+#define PACKAGE_MAGIC 0x4b503247 // G2PK
+#define PACKAGE_VERSION 1
+#define PACKAGE_MAX_SECTIONS 16
+
+struct PackageHeader
+{
+    unsigned int magic;
+    unsigned int version;
+    unsigned int section_count;
+    unsigned int table_crc; // of the section entries
+};
+
+struct PackageEntry
+{
+    unsigned int type;
+    unsigned int crc;
+    unsigned long long offset;
+    unsigned long long size;
+};
+
+static size_t align_size(size_t size, size_t align)
+{
+    return (size + align - 1) / align * align;
+}
+
+struct Crc32Table
+{
+    Crc32Table()
+    {
+        for (unsigned int i = 0; i < 256; i++)
+        {
+            unsigned int c = i;
+            for (int k = 0; k < 8; k++)
+                c = c & 1 ? 0xedb88320 ^ (c >> 1) : c >> 1;
+            entries[i] = c;
+        }
+    }
+
+    unsigned int entries[256];
+};
+
+unsigned int crc32(const unsigned char* data, size_t size, unsigned int crc)
+{
+    static const Crc32Table table;
+
+    crc = ~crc;
+    for (size_t i = 0; i < size; i++)
+        crc = table.entries[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+    return ~crc;
+}
+
+Package::Package()
+{
+}
+
+int Package::open(const char* path, bool verify_weights)
+{
+    if (file.open(path) != 0)
+        return -1;
+
+    return validate(verify_weights);
+}
+
+#if __ANDROID_API__ >= 9
+int Package::open(AAssetManager* mgr, const char* assetpath, bool verify_weights)
+{
+    if (file.open(mgr, assetpath) != 0)
+        return -1;
+
+    return validate(verify_weights);
+}
+#endif
+
+void Package::close()
+{
+    file.close();
+}
+
+int Package::validate(bool verify_weights)
+{
+    const unsigned char* mem = file.data();
+    const size_t size = file.size();
+
+    const PackageHeader* header = (const PackageHeader*)mem;
+    if (size < sizeof(PackageHeader) || header->magic != PACKAGE_MAGIC)
+    {
+        fprintf(stderr, "not a gpt2 package\n");
+        close();
+        return -1;
+    }
+    if (header->version != PACKAGE_VERSION || header->section_count > PACKAGE_MAX_SECTIONS || size < sizeof(PackageHeader) + header->section_count * sizeof(PackageEntry))
+    {
+        fprintf(stderr, "gpt2 package version %u with %u sections unsupported\n", header->version, header->section_count);
+        close();
+        return -1;
+    }
+
+    const PackageEntry* entries = (const PackageEntry*)(mem + sizeof(PackageHeader));
+    if (crc32((const unsigned char*)entries, header->section_count * sizeof(PackageEntry)) != header->table_crc)
+    {
+        fprintf(stderr, "gpt2 package section table corrupted\n");
+        close();
+        return -1;
+    }
+
+    for (unsigned int i = 0; i < header->section_count; i++)
+    {
+        const PackageEntry& entry = entries[i];
+        if (entry.offset % 64 != 0 || entry.offset > size || entry.size > size - entry.offset)
+        {
+            fprintf(stderr, "gpt2 package section %u out of bounds\n", entry.type);
+            close();
+            return -1;
+        }
+
+        if ((entry.type == SECTION_WEIGHTS || entry.type == SECTION_PANELS) && !verify_weights)
+            continue;
+
+        if (crc32(mem + entry.offset, (size_t)entry.size) != entry.crc)
+        {
+            fprintf(stderr, "gpt2 package section %u checksum mismatch\n", entry.type);
+            close();
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+const unsigned char* Package::section(int type, size_t* size) const
+{
+    if (file.empty())
+        return 0;
+
+    const PackageHeader* header = (const PackageHeader*)file.data();
+    const PackageEntry* entries = (const PackageEntry*)(file.data() + sizeof(PackageHeader));
+    for (unsigned int i = 0; i < header->section_count; i++)
+    {
+        if ((int)entries[i].type != type)
+            continue;
+        if (size)
+            *size = (size_t)entries[i].size;
+        return file.data() + entries[i].offset;
+    }
+    return 0;
+}
+
+int Package::write(const char* path, const PackageInput* sections, int count)
+{
+    if (count < 0 || count > PACKAGE_MAX_SECTIONS)
+        return -1;
+
+    PackageHeader header;
+    memset(&header, 0, sizeof(header));
+    header.magic = PACKAGE_MAGIC;
+    header.version = PACKAGE_VERSION;
+    header.section_count = count;
+
+    std::vector<PackageEntry> entries(count);
+    size_t offset = align_size(sizeof(PackageHeader) + count * sizeof(PackageEntry), 64);
+    for (int i = 0; i < count; i++)
+    {
+        entries[i].type = sections[i].type;
+        entries[i].crc = crc32((const unsigned char*)sections[i].data, sections[i].size);
+        entries[i].offset = offset;
+        entries[i].size = sections[i].size;
+        offset = align_size(offset + sections[i].size, 64);
+    }
+    header.table_crc = crc32((const unsigned char*)entries.data(), count * sizeof(PackageEntry));
+
+    FILE* fp = fopen(path, "wb");
+    if (!fp)
+    {
+        fprintf(stderr, "fopen %s failed\n", path);
+        return -1;
+    }
+
+    // sections go one after another with zero padding, nothing is buffered twice
+    static const unsigned char zeros[64] = {0};
+    size_t written = fwrite(&header, sizeof(header), 1, fp) * sizeof(header);
+    if (count > 0)
+        written += fwrite(entries.data(), sizeof(PackageEntry), count, fp) * sizeof(PackageEntry);
+    for (int i = 0; i < count; i++)
+    {
+        written += fwrite(zeros, 1, (size_t)entries[i].offset - written, fp);
+        written += fwrite(sections[i].data, 1, sections[i].size, fp);
+    }
+    written += fwrite(zeros, 1, offset - written, fp);
+
+    const bool ok = fclose(fp) == 0 && written == offset;
+    if (!ok)
+    {
+        fprintf(stderr, "write %s failed\n", path);
+        return -1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,74 @@
+#ifndef PACKAGE_H
+#define PACKAGE_H
+
+#include <stddef.h>
+
+#include "mappedfile.h"
+
+// sections of a packed model
+enum PackageSection
+{
+    SECTION_CONFIG = 1,    // ModelConfig the weights were packed for
+    SECTION_PARAM = 2,     // gpt2.param text
+    SECTION_WEIGHTS = 3,   // fp32 tensors in load order, each 64 byte aligned, see Model::pack_weights
+    SECTION_TOKENIZER = 4, // compiled vocab, see Tokenizer::compile
+    SECTION_CHECKSUMS = 5, // optional crc32 of every weight region, see Model::weight_checksums
+    SECTION_PREPACK = 6,   // PrepackKey of a prepack cache, see Model::prepack
+    SECTION_PANELS = 7     // gemm weights of a prepack cache in column panels, each 64 byte aligned
+};
+
+// what a prepack cache was packed from and for
+struct PrepackKey
+{
+    unsigned int model_hash;
+    int panel_width;
+    char isa[8];
+};
+
+// crc32 with the zlib polynomial, crc continues a previous call
+unsigned int crc32(const unsigned char* data, size_t size, unsigned int crc = 0);
+
+struct PackageInput
+{
+    int type;
+    const void* data;
+    size_t size;
+};
+
+// the whole model in one file instead of gpt2.param, the split gpt2.bin parts and vocab.txt
+// a header and section table, then the sections, each 64 byte aligned so that tensors are used in place from the mapping
+// an apk asset is only 4 byte aligned by zipalign, which is still enough to use it in place
+// every section carries a crc32, native endian like the compiled tokenizer
+class Package
+{
+public:
+    Package();
+
+    // the table and the small sections are always checked, the weights and panels only with verify_weights,
+    // checking them reads every page, which a mapped load otherwise leaves to the first forward
+    int open(const char* path, bool verify_weights = false);
+#if __ANDROID_API__ >= 9
+    int open(AAssetManager* mgr, const char* assetpath, bool verify_weights = false);
+#endif
+    void close();
+
+    // null if the package has no such section
+    const unsigned char* section(int type, size_t* size) const;
+
+    // the mapping the sections point into
+    const MappedFile& mapping() const { return file; }
+
+    // the sections are laid out in the order given
+    static int write(const char* path, const PackageInput* sections, int count);
+
+private:
+    Package(const Package&);
+    Package& operator=(const Package&);
+
+    int validate(bool verify_weights);
+
+private:
+    MappedFile file;
+};
+
+#endif // PACKAGE_H
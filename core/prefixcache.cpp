@@ -0,0 +1,191 @@
+#include "prefixcache.h"
+
+#include "kvcache.h"
+
+#include <algorithm>
+#include <string.h>
+
+static unsigned int hash_tokens(const int* tokens, int n)
+{
+    unsigned int h = 2166136261u;
+    for (int i = 0; i < n; i++)
+    {
+        h ^= (unsigned int)tokens[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+PrefixCache::PrefixCache(KVPool* _pool, int _max_blocks)
+    : pool(_pool), max_blocks(_max_blocks)
+{
+    root.block = 0;
+    root.parent = 0;
+    root.last_used = 0;
+    nblocks = 0;
+    clock = 0;
+}
+
+PrefixCache::~PrefixCache()
+{
+    clear();
+}
+
+PrefixCache::Node* PrefixCache::find_child(Node* node, const int* tokens) const
+{
+    const int bs = pool->block_size();
+    const unsigned int h = hash_tokens(tokens, bs);
+
+    auto range = node->children.equal_range(h);
+    for (auto it = range.first; it != range.second; ++it)
+    {
+        if (memcmp(it->second->tokens.data(), tokens, bs * sizeof(int)) == 0)
+            return it->second;
+    }
+    return 0;
+}
+
+int PrefixCache::match(const int* ids, int n, KVCache& kv)
+{
+    const int bs = pool->block_size();
+
+    std::vector<unsigned char*> blocks;
+    {
+        std::lock_guard<std::mutex> g(lock);
+
+        clock++;
+        Node* node = &root;
+        for (int pos = 0; pos + bs <= n; pos += bs)
+        {
+            Node* child = find_child(node, ids + pos);
+            if (!child)
+                break;
+            child->last_used = clock;
+            blocks.push_back(child->block);
+            node = child;
+        }
+
+        // retain while the tree cannot drop them
+        if (blocks.empty() || kv.attach(blocks.data(), (int)blocks.size()) != 0)
+            return 0;
+    }
+
+    return (int)blocks.size() * bs;
+}
+
+void PrefixCache::insert(const int* ids, int n, const KVCache& kv)
+{
+    const int bs = pool->block_size();
+    const int nfull = std::min(n, kv.size()) / bs;
+
+    std::lock_guard<std::mutex> g(lock);
+
+    clock++;
+    Node* node = &root;
+    for (int i = 0; i < nfull; i++)
+    {
+        const int* tokens = ids + i * bs;
+        Node* child = find_child(node, tokens);
+        if (!child)
+        {
+            child = new Node;
+            child->tokens.assign(tokens, tokens + bs);
+            child->block = kv.block(i);
+            child->parent = node;
+            pool->retain(child->block);
+            node->children.insert(std::make_pair(hash_tokens(tokens, bs), child));
+            nblocks++;
+        }
+        child->last_used = clock;
+        node = child;
+    }
+
+    // the path just inserted is the most recent, it is never the victim
+    evict_locked(max_blocks, clock);
+}
+
+PrefixCache::Node* PrefixCache::lru_leaf()
+{
+    Node* victim = 0;
+    std::vector<Node*> stack(1, &root);
+    while (!stack.empty())
+    {
+        Node* node = stack.back();
+        stack.pop_back();
+        for (auto it = node->children.begin(); it != node->children.end(); ++it)
+            stack.push_back(it->second);
+        if (node != &root && node->children.empty() && (!victim || node->last_used < victim->last_used))
+            victim = node;
+    }
+    return victim;
+}
+
+void PrefixCache::evict_locked(int _max_blocks, unsigned long long keep)
+{
+    while (nblocks > _max_blocks)
+    {
+        Node* victim = lru_leaf();
+        if (!victim || victim->last_used == keep)
+            break;
+        drop(victim);
+    }
+}
+
+void PrefixCache::drop(Node* node)
+{
+    while (!node->children.empty())
+        drop(node->children.begin()->second);
+
+    Node* parent = node->parent;
+    const unsigned int h = hash_tokens(node->tokens.data(), (int)node->tokens.size());
+    auto range = parent->children.equal_range(h);
+    for (auto it = range.first; it != range.second; ++it)
+    {
+        if (it->second == node)
+        {
+            parent->children.erase(it);
+            break;
+        }
+    }
+
+    pool->release(node->block);
+    delete node;
+    nblocks--;
+}
+
+void PrefixCache::evict(int _max_blocks)
+{
+    std::lock_guard<std::mutex> g(lock);
+
+    if (_max_blocks <= 0)
+    {
+        while (!root.children.empty())
+            drop(root.children.begin()->second);
+        return;
+    }
+
+    evict_locked(_max_blocks, 0);
+}
+
+int PrefixCache::reclaim(int count)
+{
+    std::lock_guard<std::mutex> g(lock);
+
+    int freed = 0;
+    while (freed < count)
+    {
+        Node* victim = lru_leaf();
+        if (!victim)
+            break;
+        if (pool->refcount(victim->block) == 1)
+            freed++;
+        drop(victim);
+    }
+    return freed;
+}
+
+int PrefixCache::cached_blocks() const
+{
+    std::lock_guard<std::mutex> g(lock);
+    return nblocks;
+}
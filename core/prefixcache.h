@@ -0,0 +1,68 @@
+#ifndef PREFIXCACHE_H
+#define PREFIXCACHE_H
+
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+class KVCache;
+class KVPool;
+
+// radix tree of token sequences whose kv blocks stay around after their sessions moved on
+// a node is one full kv block keyed by its block_size token ids, the path from the root is the prefix
+// prompts that start the same way, [CLS] and a fixed persona or instruction, prefill only the rest
+// all calls are thread-safe
+class PrefixCache
+{
+public:
+    // keep at most max_blocks blocks, least recently used leaves go first
+    PrefixCache(KVPool* pool, int max_blocks);
+    ~PrefixCache();
+
+    // share the longest cached prefix of ids into kv, which must be empty
+    // return the number of positions reused, a multiple of the block size
+    int match(const int* ids, int n, KVCache& kv);
+
+    // publish the full blocks of kv, whose first n positions hold ids
+    void insert(const int* ids, int n, const KVCache& kv);
+
+    // drop least recently used leaves until at most max_blocks are cached
+    void evict(int max_blocks);
+    void clear() { evict(0); }
+
+    // drop least recently used leaves until count blocks went back to the pool
+    // a block still shared with a session frees nothing, return the blocks freed
+    int reclaim(int count);
+
+    int cached_blocks() const;
+
+private:
+    PrefixCache(const PrefixCache&);
+    PrefixCache& operator=(const PrefixCache&);
+
+    struct Node
+    {
+        std::vector<int> tokens;
+        unsigned char* block;
+        Node* parent;
+        std::unordered_multimap<unsigned int, Node*> children;
+        unsigned long long last_used;
+    };
+
+    Node* find_child(Node* node, const int* tokens) const;
+    Node* lru_leaf();
+    // keep is the clock of the entries that must survive
+    void evict_locked(int max_blocks, unsigned long long keep);
+    void drop(Node* node);
+
+private:
+    KVPool* pool;
+    int max_blocks;
+
+    mutable std::mutex lock;
+    Node root;
+    int nblocks;
+    unsigned long long clock;
+};
+
+#endif // PREFIXCACHE_H
@@ -0,0 +1,449 @@
+#include "scheduler.h"
+
+#include "prefixcache.h"
+#include "session.h"
+
+#include <algorithm>
+#include <limits.h>
+#include <stdio.h>
+
+Stream::Stream()
+{
+    cancelled = false;
+    has_deadline = false;
+    tokens = 0;
+    state = STREAM_RUNNING;
+}
+
+int Stream::read(std::string& _text, int timeout_ms)
+{
+    std::unique_lock<std::mutex> g(lock);
+
+    auto ready = [&] { return !unread.empty() || state != STREAM_RUNNING; };
+    if (timeout_ms < 0)
+        cond.wait(g, ready);
+    else
+        cond.wait_for(g, std::chrono::milliseconds(timeout_ms), ready);
+
+    if (!unread.empty())
+    {
+        _text += unread;
+        unread.clear();
+        return 1;
+    }
+    return state == STREAM_RUNNING ? 0 : -1;
+}
+
+int Stream::wait()
+{
+    std::unique_lock<std::mutex> g(lock);
+    cond.wait(g, [&] { return state != STREAM_RUNNING; });
+    return state;
+}
+
+int Stream::status() const
+{
+    std::lock_guard<std::mutex> g(lock);
+    return state;
+}
+
+std::string Stream::reply() const
+{
+    std::lock_guard<std::mutex> g(lock);
+    return text;
+}
+
+int Stream::reply_tokens() const
+{
+    std::lock_guard<std::mutex> g(lock);
+    return tokens;
+}
+
+void Stream::push(std::string_view piece)
+{
+    {
+        std::lock_guard<std::mutex> g(lock);
+        unread.append(piece.data(), piece.size());
+    }
+    cond.notify_all();
+}
+
+void Stream::finish(int status, const std::string& reply, int reply_tokens)
+{
+    {
+        std::lock_guard<std::mutex> g(lock);
+        text = reply;
+        tokens = reply_tokens;
+        state = status;
+    }
+    cond.notify_all();
+}
+
+Scheduler::Scheduler(const Model& _model)
+    : model(_model)
+{
+    max_batch = 16;
+    max_batch_tokens = 32;
+    prefill_chunk = 16;
+    num_threads = get_cpu_count();
+    prefill_threads = 0;
+    spin_count = 20000;
+    numa_node = -1;
+    prefix_cache = 0;
+    running = false;
+    stopping = false;
+    prefill_pending = false;
+    prefill_quit = false;
+}
+
+Scheduler::~Scheduler()
+{
+    stop();
+}
+
+int Scheduler::start()
+{
+    std::lock_guard<std::mutex> g(lock);
+    if (running)
+        return 0;
+
+    // the largest forward the token budget allows, planned now so that no step grows the slabs
+    const ModelConfig& config = model.config();
+    const int max_tokens = max_batch_tokens > 0 ? max_batch_tokens : config.n_ctx;
+    if (ws.reserve(config, std::max(max_tokens, max_batch), num_threads) != 0)
+        return -100;
+    if (prefill_threads > 0 && prefill_ws.reserve(config, max_tokens, prefill_threads) != 0)
+        return -100;
+
+    decode_pool.spin_count = spin_count;
+    decode_pool.numa_node = numa_node;
+    decode_pool.create(num_threads, cpus);
+    if (prefill_threads > 0)
+    {
+        prefill_pool.spin_count = spin_count;
+        prefill_pool.numa_node = numa_node;
+        prefill_pool.create(prefill_threads, prefill_cpus);
+        prefill_quit = false;
+        prefill_worker = std::thread(&Scheduler::run_prefill, this);
+    }
+
+    running = true;
+    stopping = false;
+    worker = std::thread(&Scheduler::run, this);
+    return 0;
+}
+
+void Scheduler::stop()
+{
+    {
+        std::lock_guard<std::mutex> g(lock);
+        if (!running)
+            return;
+        stopping = true;
+    }
+    cond.notify_all();
+    worker.join();
+
+    if (prefill_worker.joinable())
+    {
+        {
+            std::lock_guard<std::mutex> g(prefill_lock);
+            prefill_quit = true;
+        }
+        prefill_cond.notify_all();
+        prefill_worker.join();
+    }
+
+    decode_pool.destroy();
+    prefill_pool.destroy();
+
+    std::lock_guard<std::mutex> g(lock);
+    running = false;
+}
+
+std::shared_ptr<Stream> Scheduler::submit(Session* session, std::string_view text, const std::function<void(std::string_view)>& on_text, const std::function<void(const std::string&)>& on_done, int timeout_ms)
+{
+    std::shared_ptr<Stream> stream = std::make_shared<Stream>();
+    if (timeout_ms > 0)
+    {
+        stream->has_deadline = true;
+        stream->deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+    }
+
+    Request request;
+    request.session = session;
+    request.text = text;
+    request.on_text = [stream, on_text](std::string_view piece) {
+        stream->push(piece);
+        if (on_text)
+            on_text(piece);
+    };
+    request.on_done = on_done;
+    request.stream = stream;
+
+    {
+        std::lock_guard<std::mutex> g(lock);
+        if (!running || stopping)
+            return std::shared_ptr<Stream>();
+        waiting.push_back(request);
+    }
+    cond.notify_one();
+    return stream;
+}
+
+int Scheduler::check(const Request& request) const
+{
+    if (request.stream->cancelled)
+        return STREAM_CANCELLED;
+    if (request.stream->has_deadline && std::chrono::steady_clock::now() >= request.stream->deadline)
+        return STREAM_EXPIRED;
+    return STREAM_RUNNING;
+}
+
+void Scheduler::retire(Request& request, int status, bool begun)
+{
+    std::string reply;
+    int tokens = 0;
+    if (begun)
+    {
+        request.session->end();
+        reply = request.session->reply();
+        tokens = request.session->reply_tokens();
+    }
+
+    request.stream->finish(status, reply, tokens);
+    if (request.on_done)
+        request.on_done(reply);
+}
+
+bool Scheduler::busy(const Session* session, const std::vector<Request>& admitted) const
+{
+    for (size_t i = 0; i < active.size(); i++)
+    {
+        if (active[i].session == session)
+            return true;
+    }
+    for (size_t i = 0; i < admitted.size(); i++)
+    {
+        if (admitted[i].session == session)
+            return true;
+    }
+    return false;
+}
+
+int Scheduler::forward(const BatchItem* items, int count, Workspace& workspace, ThreadPool& pool)
+{
+    for (;;)
+    {
+        const int ret = model.forward(items, count, workspace, &pool);
+        if (ret != -100 || !prefix_cache)
+            return ret;
+
+        // the workspace was planned in start(), -100 here is the kv pool
+        // blocks still missing, at least one for a shared block that is copied before it is written
+        int missing = 0;
+        for (int i = 0; i < count; i++)
+        {
+            const KVCache& kv = *items[i].kv;
+            const int blocks = (kv.size() + items[i].n + kv.block_size() - 1) / kv.block_size();
+            missing += std::max(blocks - kv.block_count(), 0);
+        }
+        if (prefix_cache->reclaim(std::max(missing, 1)) == 0)
+            return ret;
+    }
+}
+
+void Scheduler::forward(const std::vector<BatchItem>& items, std::vector<char>& failed, Workspace& workspace, ThreadPool& pool)
+{
+    failed.assign(items.size(), 0);
+    if (items.empty() || forward(items.data(), (int)items.size(), workspace, pool) == 0)
+        return;
+
+    // a batch is checked before anything runs, the kv pool is exhausted even without the prefix cache
+    // run the sessions one by one and retire the ones that cannot continue
+    for (size_t i = 0; i < items.size(); i++)
+        failed[i] = forward(&items[i], 1, workspace, pool) != 0;
+}
+
+void Scheduler::run_prefill()
+{
+    if (!prefill_cpus.empty())
+        set_thread_affinity(std::vector<int>(1, prefill_cpus[0]));
+
+    for (;;)
+    {
+        {
+            std::unique_lock<std::mutex> g(prefill_lock);
+            prefill_cond.wait(g, [&] { return prefill_quit || prefill_pending; });
+            if (prefill_quit)
+                return;
+        }
+
+        forward(prefill_batch, prefill_failed, prefill_ws, prefill_pool);
+
+        {
+            std::lock_guard<std::mutex> g(prefill_lock);
+            prefill_pending = false;
+        }
+        prefill_cond.notify_all();
+    }
+}
+
+void Scheduler::run()
+{
+    if (!cpus.empty())
+        set_thread_affinity(std::vector<int>(1, cpus[0]));
+
+    for (;;)
+    {
+        std::vector<Request> admitted;
+        {
+            std::unique_lock<std::mutex> g(lock);
+            cond.wait(g, [&] { return stopping || !waiting.empty() || !active.empty(); });
+            if (stopping && waiting.empty() && active.empty())
+                break;
+
+            // the turns of one session run in the order they came
+            std::deque<Request>::iterator it = waiting.begin();
+            while ((int)(active.size() + admitted.size()) < std::max(max_batch, 1) && it != waiting.end())
+            {
+                if (busy(it->session, admitted))
+                {
+                    ++it;
+                    continue;
+                }
+                admitted.push_back(*it);
+                it = waiting.erase(it);
+            }
+        }
+
+        // the prompt of a new turn runs in the same forward as the decode steps of the others
+        for (size_t i = 0; i < admitted.size(); i++)
+        {
+            const int status = check(admitted[i]);
+            if (status != STREAM_RUNNING)
+                retire(admitted[i], status, false);
+            else if (admitted[i].session->begin(admitted[i].text) != 0)
+                retire(admitted[i], STREAM_FAILED);
+            else
+                active.push_back(admitted[i]);
+        }
+
+        // abandoned turns stop here instead of running to max_len
+        size_t k = 0;
+        for (size_t i = 0; i < active.size(); i++)
+        {
+            const int status = check(active[i]);
+            if (status == STREAM_RUNNING)
+                active[k++] = active[i];
+            else
+                retire(active[i], status);
+        }
+        active.resize(k);
+        if (active.empty())
+            continue;
+
+        // one token for each decoding session, the prompts get chunks of what is left in admission order
+        int budget = max_batch_tokens > 0 ? max_batch_tokens : INT_MAX;
+        chunk.assign(active.size(), 0);
+        for (size_t i = 0; i < active.size(); i++)
+        {
+            if (active[i].session->pending().size() == 1)
+            {
+                chunk[i] = 1;
+                budget--;
+            }
+        }
+        for (size_t i = 0; i < active.size() && budget > 0; i++)
+        {
+            const int n = (int)active[i].session->pending().size();
+            if (n > 1)
+            {
+                chunk[i] = std::min(std::min(n, prefill_chunk > 0 ? prefill_chunk : n), budget);
+                budget -= chunk[i];
+            }
+        }
+
+        // with a prefill pool the prompt chunks go to a batch of their own
+        const bool split = prefill_threads > 0;
+        slot.assign(active.size(), 0);
+        batch.clear();
+        prefill_batch.clear();
+        for (size_t i = 0; i < active.size(); i++)
+        {
+            if (chunk[i] == 0)
+                continue;
+
+            Session* session = active[i].session;
+            BatchItem item;
+            item.ids = session->pending().data();
+            item.n = chunk[i];
+            item.kv = &session->kvcache();
+            // logits only once the whole prompt ran
+            item.logits = chunk[i] == (int)session->pending().size() ? session->logits() : 0;
+
+            if (split && session->pending().size() > 1)
+            {
+                slot[i] = -1 - (int)prefill_batch.size();
+                prefill_batch.push_back(item);
+            }
+            else
+            {
+                slot[i] = (int)batch.size();
+                batch.push_back(item);
+            }
+        }
+
+        failed.clear();
+        prefill_failed.clear();
+        if (!prefill_batch.empty() && !batch.empty())
+        {
+            {
+                std::lock_guard<std::mutex> g(prefill_lock);
+                prefill_pending = true;
+            }
+            prefill_cond.notify_all();
+
+            forward(batch, failed, ws, decode_pool);
+
+            std::unique_lock<std::mutex> g(prefill_lock);
+            prefill_cond.wait(g, [&] { return !prefill_pending; });
+        }
+        else if (!prefill_batch.empty())
+        {
+            forward(prefill_batch, prefill_failed, prefill_ws, prefill_pool);
+        }
+        else
+        {
+            forward(batch, failed, ws, decode_pool);
+        }
+
+        size_t j = 0;
+        for (size_t i = 0; i < active.size(); i++)
+        {
+            Session* session = active[i].session;
+            if (chunk[i] == 0)
+            {
+                active[j++] = active[i];
+            }
+            else if (slot[i] >= 0 ? failed[slot[i]] : prefill_failed[-1 - slot[i]])
+            {
+                retire(active[i], STREAM_FAILED);
+            }
+            else if (chunk[i] < (int)session->pending().size())
+            {
+                session->consume(chunk[i]);
+                active[j++] = active[i];
+            }
+            else if (session->step(active[i].on_text))
+            {
+                active[j++] = active[i];
+            }
+            else
+            {
+                retire(active[i], STREAM_DONE);
+            }
+        }
+        active.resize(j);
+    }
+}
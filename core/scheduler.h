@@ -0,0 +1,180 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "model.h"
+#include "threadpool.h"
+
+class PrefixCache;
+class Session;
+
+enum StreamStatus
+{
+    STREAM_RUNNING = 0,
+    STREAM_DONE = 1,
+    STREAM_CANCELLED = 2,
+    STREAM_EXPIRED = 3,
+    STREAM_FAILED = 4
+};
+
+// handle of a submitted chat turn, the reply can be read from any thread while it is generated
+class Stream
+{
+public:
+    Stream();
+
+    // the turn ends before its next step, the reply so far stays in the history
+    void cancel() { cancelled = true; }
+
+    // move the text generated since the last read into text
+    // return 1 with new text, 0 if none came within timeout_ms, -1 once the turn is over and all text was read
+    // timeout_ms -1 waits
+    int read(std::string& text, int timeout_ms = -1);
+
+    // block until the turn is over
+    int wait();
+
+    // StreamStatus
+    int status() const;
+    // the whole reply, complete once status() is no longer STREAM_RUNNING
+    std::string reply() const;
+    // its length in tokens
+    int reply_tokens() const;
+
+private:
+    Stream(const Stream&);
+    Stream& operator=(const Stream&);
+
+    friend class Scheduler;
+    void push(std::string_view text);
+    void finish(int status, const std::string& reply, int tokens);
+
+private:
+    std::atomic<bool> cancelled;
+    bool has_deadline;
+    std::chrono::steady_clock::time_point deadline;
+
+    mutable std::mutex lock;
+    std::condition_variable cond;
+    std::string unread;
+    std::string text;
+    int tokens;
+    int state;
+};
+
+// continuous batching over many sessions
+// every step runs the pending tokens of all active sessions in one forward, the next token of
+// the decoding ones and the prompt of the newly admitted ones, so the weights are read once per
+// step instead of once per session, new turns join and finished ones retire between steps
+// long prompts run in chunks under a per-step token budget, a re-prefilled history does not stall
+// the token stream of the other sessions
+class Scheduler
+{
+public:
+    Scheduler(const Model& model);
+    ~Scheduler();
+
+    int start();
+    // let the queued and running turns finish, then join the worker
+    void stop();
+
+    // queue one chat turn and return at once, null if the scheduler is not running
+    // the session belongs to the scheduler until the turn is over, turns of one session run in order
+    // on_text and on_done, if set, run on the scheduler thread, the stream can be read from any thread
+    // a turn still running timeout_ms after submit is stopped as if cancelled, 0 for no deadline
+    std::shared_ptr<Stream> submit(Session* session, std::string_view text, const std::function<void(std::string_view)>& on_text = nullptr, const std::function<void(const std::string&)>& on_done = nullptr, int timeout_ms = 0);
+
+public:
+    // sessions per step
+    int max_batch;
+    // tokens per step, decode steps come first and prompts share the rest, 0 for no limit
+    int max_batch_tokens;
+    // prompt tokens of one session per step, 0 for the whole prompt at once
+    int prefill_chunk;
+
+    // threads of the decode pool, the scheduler thread included, thread i is pinned to cpus[i % cpus.size()]
+    int num_threads;
+    std::vector<int> cpus;
+    // prompt chunks run on a pool of their own, at the same time as the decode step, so a long prompt
+    // never holds up the next token of the others, 0 runs them in the decode step
+    int prefill_threads;
+    std::vector<int> prefill_cpus;
+    // ThreadPool::spin_count of both pools
+    int spin_count;
+    // ThreadPool::numa_node of both pools, one scheduler per node with its cpus reads the local replica of the weights
+    int numa_node;
+    // the cache of the sessions, its unused blocks are given back when the kv pool runs dry, null for none
+    PrefixCache* prefix_cache;
+
+private:
+    Scheduler(const Scheduler&);
+    Scheduler& operator=(const Scheduler&);
+
+    void run();
+    // runs the prompt chunks of a step on the prefill pool while the scheduler thread decodes
+    void run_prefill();
+    // retire on failure, every item on its own after the batch failed
+    // an exhausted kv pool first takes back the blocks of the prefix cache and runs again
+    int forward(const BatchItem* items, int count, Workspace& workspace, ThreadPool& pool);
+    void forward(const std::vector<BatchItem>& items, std::vector<char>& failed, Workspace& workspace, ThreadPool& pool);
+
+    struct Request
+    {
+        Session* session;
+        std::string text;
+        std::function<void(std::string_view)> on_text;
+        std::function<void(const std::string&)> on_done;
+        std::shared_ptr<Stream> stream;
+    };
+
+    // the session has a turn running or admitted
+    bool busy(const Session* session, const std::vector<Request>& admitted) const;
+    // STREAM_RUNNING while the request goes on
+    int check(const Request& request) const;
+    // the turn is over, end() the session if it began
+    void retire(Request& request, int status, bool begun = true);
+
+private:
+    const Model& model;
+
+    std::thread worker;
+    std::mutex lock;
+    std::condition_variable cond;
+    bool running;
+    bool stopping;
+    std::deque<Request> waiting;
+
+    // owned by the worker
+    std::vector<Request> active;
+    std::vector<BatchItem> batch;
+    std::vector<BatchItem> prefill_batch;
+    std::vector<int> chunk;
+    // batch index of every active request, negative in the prefill batch
+    std::vector<int> slot;
+    std::vector<char> failed;
+    std::vector<char> prefill_failed;
+    Workspace ws;
+    Workspace prefill_ws;
+    ThreadPool decode_pool;
+    ThreadPool prefill_pool;
+
+    // the prefill driver, pinned to prefill_cpus[0] once, a step hands it the prefill batch
+    std::thread prefill_worker;
+    std::mutex prefill_lock;
+    std::condition_variable prefill_cond;
+    bool prefill_pending;
+    bool prefill_quit;
+};
+
+#endif // SCHEDULER_H
@@ -0,0 +1,241 @@
+#include "session.h"
+
+#include "detokenizer.h"
+#include "prefixcache.h"
+#include "tokenizer.h"
+
+#include <algorithm>
+#include <math.h>
+#include <stdio.h>
+#include <thread>
+
+Session::Session(const Model& _model, const Tokenizer& _tokenizer, KVPool* _pool, PrefixCache* _prefix_cache)
+    : model(_model), tokenizer(_tokenizer), detokenizer(_tokenizer)
+{
+    pool = _pool;
+    prefix_cache = _pool ? _prefix_cache : 0;
+    if (!pool)
+    {
+        private_pool.create(model.config());
+        pool = &private_pool;
+    }
+
+    max_history_len = 3;
+    context_slack = 64;
+    max_len = 25;
+    top_k = 8;
+    thread_pool = 0;
+    num_threads = get_cpu_count();
+
+    std::random_device rd;
+    rng.seed(rd());
+}
+
+void Session::clear()
+{
+    history.clear();
+    kv.clear();
+    kv_ids.clear();
+    pending_ids.clear();
+}
+
+// top-k sampling at temperature 1, the same as GPT2-chitchat
+int Session::sample()
+{
+    std::vector<float>& logits = logits_data;
+    const int n = (int)logits.size();
+    const int k = std::min(std::max(top_k, 1), (int)top_probs.size());
+
+    // never generate [UNK]
+    if (tokenizer.unk_id >= 0 && tokenizer.unk_id < n)
+        logits[tokenizer.unk_id] = -INFINITY;
+
+    std::vector<int>& top = top_ids;
+    for (int i = 0; i < n; i++)
+        top[i] = i;
+    std::partial_sort(top.begin(), top.begin() + k, top.end(), [&](int a, int b) { return logits[a] > logits[b]; });
+
+    float* prob = top_probs.data();
+    float sum = 0.f;
+    for (int i = 0; i < k; i++)
+    {
+        prob[i] = expf(logits[top[i]] - logits[top[0]]);
+        sum += prob[i];
+    }
+
+    float r = std::uniform_real_distribution<float>(0.f, sum)(rng);
+    for (int i = 0; i < k; i++)
+    {
+        r -= prob[i];
+        if (r < 0.f)
+            return top[i];
+    }
+    return top[k - 1];
+}
+
+// whole turns leave the window from the front, the last one always fits
+// positions are absolute, so the kv of the turns that stay is only reused while the front of the window holds still
+void Session::fit_history(int budget)
+{
+    const size_t max_turns = std::max(max_history_len, 1);
+    if (history.size() > max_turns)
+        history.erase(history.begin(), history.end() - max_turns);
+
+    // [CLS] and a [SEP] per turn
+    int len = 1;
+    for (size_t i = 0; i < history.size(); i++)
+        len += (int)history[i].size() + 1;
+    if (len <= budget)
+        return;
+
+    const int target = std::max(budget - std::max(context_slack, 0), 0);
+    size_t drop = 0;
+    while (drop + 1 < history.size() && len > target)
+    {
+        len -= (int)history[drop].size() + 1;
+        drop++;
+    }
+    history.erase(history.begin(), history.begin() + drop);
+}
+
+int Session::begin(std::string_view text)
+{
+    const ModelConfig& config = model.config();
+
+    if (kv.capacity() == 0 && kv.create(config, pool) != 0)
+        return -1;
+
+    // everything a decode step touches is sized here, steps then leave the heap alone
+    if ((int)logits_data.size() != config.n_vocab)
+    {
+        logits_data.resize(config.n_vocab);
+        top_ids.resize(config.n_vocab);
+    }
+    top_probs.resize(std::min(std::max(top_k, 1), config.n_vocab));
+    kv_ids.reserve(config.n_ctx);
+    pending_ids.reserve(config.n_ctx);
+    response.reserve(max_len);
+
+    // the prompt gets what a max_len reply leaves of the context, at least half
+    const int budget = config.n_ctx - std::min(max_len, config.n_ctx / 2);
+
+    // an utterance that cannot fit even alone keeps its end, next to the reply
+    std::vector<int> utterance = tokenizer.encode(text);
+    if ((int)utterance.size() > budget - 2)
+        utterance.erase(utterance.begin(), utterance.end() - (budget - 2));
+
+    history.push_back(utterance);
+    fit_history(budget);
+
+    response.clear();
+    reply_text.clear();
+    // pieces are at most a few characters, a long one may still grow the string
+    reply_text.reserve((size_t)max_len * 8);
+    detokenizer.reset();
+
+    // [CLS] utterance [SEP] utterance [SEP] ...
+    std::vector<int> input_ids(1, tokenizer.cls_id);
+    for (size_t i = 0; i < history.size(); i++)
+    {
+        input_ids.insert(input_ids.end(), history[i].begin(), history[i].end());
+        input_ids.push_back(tokenizer.sep_id);
+    }
+
+    // keep the longest cached prefix, but always run at least one token to get logits
+    size_t keep = 0;
+    while (keep < kv_ids.size() && keep < input_ids.size() && kv_ids[keep] == input_ids[keep])
+        keep++;
+
+    // some other session may have run a longer prefix
+    if (prefix_cache && keep + pool->block_size() <= input_ids.size())
+    {
+        KVCache shared;
+        shared.create(config, pool);
+        size_t matched = prefix_cache->match(input_ids.data(), (int)input_ids.size(), shared);
+        if (matched > keep)
+        {
+            kv.swap(shared);
+            kv_ids.assign(input_ids.begin(), input_ids.begin() + matched);
+            keep = matched;
+        }
+    }
+
+    if (keep == input_ids.size())
+        keep--;
+
+    kv.resize((int)keep);
+    kv_ids.resize(keep);
+    pending_ids.assign(input_ids.begin() + keep, input_ids.end());
+
+    if (kv.size() + (int)pending_ids.size() > kv.capacity())
+    {
+        fprintf(stderr, "prompt of %d tokens exceeds the %d position context\n", (int)input_ids.size(), kv.capacity());
+        pending_ids.clear();
+        return -1;
+    }
+
+    return 0;
+}
+
+void Session::consume(int n)
+{
+    n = std::min(std::max(n, 0), (int)pending_ids.size());
+    kv_ids.insert(kv_ids.end(), pending_ids.begin(), pending_ids.begin() + n);
+    pending_ids.erase(pending_ids.begin(), pending_ids.begin() + n);
+}
+
+int Session::step(const std::function<void(std::string_view)>& on_text)
+{
+    // the pending tokens are in the kv cache now
+    kv_ids.insert(kv_ids.end(), pending_ids.begin(), pending_ids.end());
+    pending_ids.clear();
+
+    int next_token = sample();
+    if (next_token == tokenizer.sep_id)
+        return 0;
+
+    response.push_back(next_token);
+
+    std::string_view piece = detokenizer.push(next_token);
+    reply_text += piece;
+    if (on_text && !piece.empty())
+        on_text(piece);
+
+    if ((int)response.size() >= max_len || kv.size() == kv.capacity())
+        return 0;
+
+    pending_ids.push_back(next_token);
+    return 1;
+}
+
+void Session::end()
+{
+    // blocks reserved for a forward that never ran go back to the pool
+    kv.resize(kv.size());
+    pending_ids.clear();
+
+    if (prefix_cache)
+        prefix_cache->insert(kv_ids.data(), (int)kv_ids.size(), kv);
+    history.push_back(response);
+}
+
+std::string Session::chat(std::string_view text, const std::function<void(std::string_view)>& on_text)
+{
+    ThreadPool* threads = thread_pool;
+    if (!threads)
+    {
+        if (private_threads.num_threads() != std::max(num_threads, 1))
+            private_threads.create(num_threads);
+        threads = &private_threads;
+    }
+
+    if (begin(text) == 0)
+    {
+        while (model.forward(pending_ids.data(), (int)pending_ids.size(), kv, ws, logits_data.data(), threads) == 0 && step(on_text))
+        {
+        }
+    }
+    end();
+
+    return reply_text;
+}
@@ -0,0 +1,107 @@
+#ifndef SESSION_H
+#define SESSION_H
+
+#include <functional>
+#include <random>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "detokenizer.h"
+#include "kvcache.h"
+#include "model.h"
+#include "threadpool.h"
+
+class PrefixCache;
+class Tokenizer;
+
+// one conversation over a shared model
+// owns everything that changes while chatting: history, kv cache, rng and scratch buffers
+// a session is used by one thread at a time, any number of sessions may share a model and tokenizer
+class Session
+{
+public:
+    // kv blocks come from pool, shared with other sessions, or from a private pool if null
+    // with a prefix cache over the same pool, prompts reuse the kv of any session that ran the same prefix
+    Session(const Model& model, const Tokenizer& tokenizer, KVPool* pool = 0, PrefixCache* prefix_cache = 0);
+
+    // one user turn, the reply is returned and both are kept in the history
+    // on_text, if set, gets each piece of the reply as soon as its token is sampled
+    std::string chat(std::string_view text, const std::function<void(std::string_view)>& on_text = nullptr);
+
+    // forget the conversation
+    void clear();
+
+    // chat() split into steps, so that a Scheduler can run many sessions in one forward
+    // begin() queues the prompt tokens that are not cached yet
+    int begin(std::string_view text);
+    // the tokens the next forward has to run, the logits of the last one go to logits()
+    const std::vector<int>& pending() const { return pending_ids; }
+    float* logits() { return logits_data.data(); }
+    KVCache& kvcache() { return kv; }
+    // call after the first n pending tokens ran without logits, a prompt can run in chunks
+    void consume(int n);
+    // call after the pending tokens ran, samples the next token and queues it
+    // return 1 while the reply goes on, 0 once it is complete
+    int step(const std::function<void(std::string_view)>& on_text = nullptr);
+    // store the reply in the history
+    void end();
+    // the reply of the current or last turn
+    const std::string& reply() const { return reply_text; }
+    // its length in tokens
+    int reply_tokens() const { return (int)response.size(); }
+
+    void set_seed(unsigned int seed) { rng.seed(seed); }
+
+public:
+    // utterances fed back as context, the current one included
+    int max_history_len;
+    // when the prompt and a max_len reply would overflow the context, oldest turns are dropped
+    // until this many more positions are free, so the next turns extend the cached prompt instead of running it again
+    int context_slack;
+    // reply length limit in tokens
+    int max_len;
+    // sample from the k most likely tokens
+    int top_k;
+    // chat() runs the model on thread_pool, which other sessions may share, or on a private pool of num_threads if null
+    ThreadPool* thread_pool;
+    int num_threads;
+
+private:
+    Session(const Session&);
+    Session& operator=(const Session&);
+
+    int sample();
+    void fit_history(int budget);
+
+private:
+    const Model& model;
+    const Tokenizer& tokenizer;
+
+    // the turns in the context window, oldest first
+    std::vector<std::vector<int>> history;
+
+    KVPool* pool;
+    KVPool private_pool;
+    PrefixCache* prefix_cache;
+    KVCache kv;
+    // token ids of the cached positions
+    std::vector<int> kv_ids;
+
+    ThreadPool private_threads;
+
+    // the current turn
+    std::vector<int> pending_ids;
+    std::vector<int> response;
+    std::string reply_text;
+    Detokenizer detokenizer;
+
+    Workspace ws;
+    std::vector<float> logits_data;
+    // sampling scratch, token ids by logit and the top_k probabilities
+    std::vector<int> top_ids;
+    std::vector<float> top_probs;
+    std::mt19937 rng;
+};
+
+#endif // SESSION_H
@@ -0,0 +1,396 @@
+#include "threadpool.h"
+
+#include <algorithm>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <sched.h>
+#include <unistd.h>
+#endif
+
+#if defined(__i386__) || defined(__x86_64__) || defined(_M_IX86) || defined(_M_X64)
+#include <immintrin.h>
+static inline void cpu_relax()
+{
+    _mm_pause();
+}
+#elif defined(__aarch64__) || defined(__arm__)
+static inline void cpu_relax()
+{
+    __asm__ __volatile__("yield");
+}
+#else
+static inline void cpu_relax()
+{
+}
+#endif
+
+// the cpus the process may run on, its affinity mask holds the cpuset of a container or a taskset
+static std::vector<int> get_allowed_cpus()
+{
+    std::vector<int> cpus;
+#if defined(_WIN32)
+    DWORD_PTR process_mask = 0;
+    DWORD_PTR system_mask = 0;
+    if (GetProcessAffinityMask(GetCurrentProcess(), &process_mask, &system_mask))
+    {
+        for (int i = 0; i < (int)sizeof(DWORD_PTR) * 8; i++)
+        {
+            if (process_mask & ((DWORD_PTR)1 << i))
+                cpus.push_back(i);
+        }
+    }
+#elif defined(__linux__)
+    // the mask of the main thread, a pinned worker asking would only see its own cpu
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (sched_getaffinity(getpid(), sizeof(set), &set) == 0)
+    {
+        for (int i = 0; i < CPU_SETSIZE; i++)
+        {
+            if (CPU_ISSET(i, &set))
+                cpus.push_back(i);
+        }
+    }
+#endif
+
+    if (cpus.empty())
+    {
+        const int count = std::max(1, (int)std::thread::hardware_concurrency());
+        for (int i = 0; i < count; i++)
+            cpus.push_back(i);
+    }
+    return cpus;
+}
+
+std::vector<int> get_cpu_list(int powersave)
+{
+    const std::vector<int> allowed = get_allowed_cpus();
+    const int count = (int)allowed.size();
+
+    std::vector<int> cpus;
+    std::vector<int> freqs(count, 0);
+#if defined(__linux__)
+    for (int i = 0; i < count; i++)
+    {
+        char path[256];
+        sprintf(path, "/sys/devices/system/cpu/cpu%d/cpufreq/cpuinfo_max_freq", allowed[i]);
+        FILE* fp = fopen(path, "rb");
+        if (!fp)
+            continue;
+        if (fscanf(fp, "%d", &freqs[i]) != 1)
+            freqs[i] = 0;
+        fclose(fp);
+    }
+#endif
+
+    const int max_freq = *std::max_element(freqs.begin(), freqs.end());
+    const int min_freq = *std::min_element(freqs.begin(), freqs.end());
+    for (int i = 0; i < count; i++)
+    {
+        if (powersave == 0 || max_freq == min_freq)
+            cpus.push_back(allowed[i]);
+        else if (powersave == 1 && freqs[i] < max_freq)
+            cpus.push_back(allowed[i]);
+        else if (powersave == 2 && freqs[i] == max_freq)
+            cpus.push_back(allowed[i]);
+    }
+    return cpus;
+}
+
+int get_cpu_count()
+{
+    int count = (int)get_allowed_cpus().size();
+
+#if defined(__linux__)
+    // a cgroup cpu quota, cgroup v2 cpu.max is "max 100000" or "200000 100000", v1 has two files
+    long long quota = -1;
+    long long period = 0;
+    FILE* fp = fopen("/sys/fs/cgroup/cpu.max", "rb");
+    if (fp)
+    {
+        char text[32];
+        if (fscanf(fp, "%31s %lld", text, &period) == 2 && strcmp(text, "max") != 0)
+            quota = atoll(text);
+        fclose(fp);
+    }
+    else
+    {
+        fp = fopen("/sys/fs/cgroup/cpu/cpu.cfs_quota_us", "rb");
+        if (fp)
+        {
+            if (fscanf(fp, "%lld", &quota) != 1)
+                quota = -1;
+            fclose(fp);
+        }
+        fp = fopen("/sys/fs/cgroup/cpu/cpu.cfs_period_us", "rb");
+        if (fp)
+        {
+            if (fscanf(fp, "%lld", &period) != 1)
+                period = 0;
+            fclose(fp);
+        }
+    }
+    if (quota > 0 && period > 0)
+        count = std::min(count, (int)((quota + period - 1) / period));
+#endif
+
+    return std::max(count, 1);
+}
+
+#if defined(__linux__)
+// a sysfs list of ranges, 0-15,32-47, empty if the file is missing
+static std::vector<int> read_range_list(const char* path)
+{
+    std::vector<int> ids;
+    FILE* fp = fopen(path, "rb");
+    if (!fp)
+        return ids;
+
+    int first = 0;
+    int last = 0;
+    int n;
+    while ((n = fscanf(fp, "%d-%d", &first, &last)) >= 1)
+    {
+        if (n == 1)
+            last = first;
+        for (int id = first; id <= last; id++)
+            ids.push_back(id);
+        if (fgetc(fp) != ',')
+            break;
+    }
+    fclose(fp);
+    return ids;
+}
+#endif
+
+std::vector<std::vector<int> > get_numa_nodes()
+{
+    std::vector<std::vector<int> > nodes;
+#if defined(__linux__)
+    const std::vector<int> allowed = get_allowed_cpus();
+
+    // node ids can have gaps, node0 and node2 after a hot unplug, the online list has the ones that are there
+    const std::vector<int> ids = read_range_list("/sys/devices/system/node/online");
+    for (size_t i = 0; i < ids.size(); i++)
+    {
+        char path[256];
+        sprintf(path, "/sys/devices/system/node/node%d/cpulist", ids[i]);
+        std::vector<int> cpus = read_range_list(path);
+
+        // cpus outside the affinity mask are not ours to pin to
+        std::vector<int>::iterator end = std::remove_if(cpus.begin(), cpus.end(), [&](int cpu) { return std::find(allowed.begin(), allowed.end(), cpu) == allowed.end(); });
+        cpus.erase(end, cpus.end());
+
+        // a node with memory and no cpus has nothing to run a pool on
+        if (!cpus.empty())
+            nodes.push_back(cpus);
+    }
+#endif
+
+    if (nodes.empty())
+        nodes.push_back(get_cpu_list(0));
+    return nodes;
+}
+
+int set_thread_affinity(const std::vector<int>& cpus)
+{
+    if (cpus.empty())
+        return -1;
+
+#ifdef _WIN32
+    DWORD_PTR mask = 0;
+    for (size_t i = 0; i < cpus.size(); i++)
+    {
+        if (cpus[i] < (int)sizeof(DWORD_PTR) * 8)
+            mask |= (DWORD_PTR)1 << cpus[i];
+    }
+    return SetThreadAffinityMask(GetCurrentThread(), mask) ? 0 : -1;
+#elif defined(__linux__)
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (size_t i = 0; i < cpus.size(); i++)
+        CPU_SET(cpus[i], &set);
+    // pid 0 is the calling thread
+    return sched_setaffinity(0, sizeof(set), &set) == 0 ? 0 : -1;
+#else
+    return -1;
+#endif
+}
+
+// the pool a worker belongs to, a job started from inside a job runs on its thread alone
+static thread_local const ThreadPool* current_pool = 0;
+
+ThreadPool::ThreadPool()
+{
+    spin_count = 20000;
+    numa_node = -1;
+    nthreads = 1;
+    quit = false;
+    remaining = 0;
+    job = 0;
+    job_threads = 0;
+    job_grain = 1;
+}
+
+ThreadPool::~ThreadPool()
+{
+    destroy();
+}
+
+int ThreadPool::create(int num_threads, const std::vector<int>& cpus)
+{
+    destroy();
+
+    nthreads = std::max(num_threads, 1);
+    slices.reset(new Slice[nthreads]);
+    for (int i = 0; i < nthreads; i++)
+    {
+        slices[i].next = 0;
+        slices[i].end = 0;
+    }
+    states.reset(new WorkerState[nthreads]);
+    for (int i = 0; i < nthreads; i++)
+    {
+        states[i].ticket = 0;
+        states[i].sleeping = false;
+    }
+
+    quit = false;
+    for (int i = 1; i < nthreads; i++)
+    {
+        const int cpu = cpus.empty() ? -1 : cpus[i % cpus.size()];
+        workers.push_back(std::thread(&ThreadPool::worker, this, i, cpu));
+    }
+    return 0;
+}
+
+void ThreadPool::destroy()
+{
+    {
+        std::lock_guard<std::mutex> g(lock);
+        quit = true;
+        for (size_t i = 0; i < workers.size(); i++)
+            states[i + 1].cond.notify_one();
+    }
+
+    for (size_t i = 0; i < workers.size(); i++)
+        workers[i].join();
+    workers.clear();
+    nthreads = 1;
+}
+
+void ThreadPool::run(int thread)
+{
+    const std::function<void(int, int, int)>& fn = *job;
+
+    // own slice first, then the leftovers of the others
+    for (int k = 0; k < job_threads; k++)
+    {
+        Slice& slice = slices[(thread + k) % job_threads];
+        for (;;)
+        {
+            const int begin = slice.next.fetch_add(job_grain);
+            if (begin >= slice.end)
+                break;
+            fn(begin, std::min(begin + job_grain, slice.end), thread);
+        }
+    }
+}
+
+void ThreadPool::worker(int index, int cpu)
+{
+    if (cpu >= 0)
+        set_thread_affinity(std::vector<int>(1, cpu));
+
+    current_pool = this;
+
+    WorkerState& state = states[index];
+    unsigned int seen = 0;
+    for (;;)
+    {
+        // spin only after a job of its own, a worker left out of the last jobs is already asleep
+        int spins = 0;
+        while (state.ticket.load(std::memory_order_acquire) == seen)
+        {
+            if (spins < spin_count)
+            {
+                spins++;
+                cpu_relax();
+                continue;
+            }
+
+            std::unique_lock<std::mutex> g(lock);
+            state.sleeping = true;
+            state.cond.wait(g, [&] { return quit || state.ticket.load(std::memory_order_acquire) != seen; });
+            state.sleeping = false;
+            if (quit)
+                return;
+        }
+        seen = state.ticket.load(std::memory_order_acquire);
+
+        run(index);
+
+        remaining.fetch_sub(1, std::memory_order_acq_rel);
+    }
+}
+
+void ThreadPool::parallel_for(int n, int grain, const std::function<void(int, int, int)>& fn, int max_threads)
+{
+    if (n <= 0)
+        return;
+
+    grain = std::max(grain, 1);
+    int t = max_threads > 0 ? std::min(max_threads, nthreads) : nthreads;
+    t = std::min(t, (n + grain - 1) / grain);
+    if (t <= 1 || current_pool == this)
+    {
+        fn(0, n, 0);
+        return;
+    }
+
+    std::lock_guard<std::mutex> submit(submit_lock);
+
+    for (int i = 0; i < t; i++)
+    {
+        // slice boundaries on grain multiples
+        const int chunks = (n + grain - 1) / grain;
+        slices[i].next = std::min(n, chunks * i / t * grain);
+        slices[i].end = std::min(n, chunks * (i + 1) / t * grain);
+    }
+    job = &fn;
+    job_threads = t;
+    job_grain = grain;
+    remaining = t - 1;
+
+    // only the t - 1 workers of this job are woken and waited for
+    {
+        std::lock_guard<std::mutex> g(lock);
+        for (int i = 1; i < t; i++)
+        {
+            states[i].ticket.fetch_add(1, std::memory_order_release);
+            if (states[i].sleeping)
+                states[i].cond.notify_one();
+        }
+    }
+
+    const ThreadPool* outer = current_pool;
+    current_pool = this;
+    run(0);
+    current_pool = outer;
+
+    // every worker of the job has to be done with it before the next one may overwrite it
+    int spins = 0;
+    while (remaining.load(std::memory_order_acquire) != 0)
+    {
+        if (spins++ < spin_count)
+            cpu_relax();
+        else
+            std::this_thread::yield();
+    }
+}
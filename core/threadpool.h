@@ -0,0 +1,94 @@
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// the cpus this process may run on, powersave 0 all, 1 little cores, 2 big cores
+// the affinity mask is honoured, cores are told apart by their max frequency, all of them when they do not differ
+std::vector<int> get_cpu_list(int powersave);
+
+// threads worth running at once, the cpus of the affinity mask capped by a cgroup cpu quota
+int get_cpu_count();
+
+// the cpus of every numa node within the affinity mask, a single node with all cpus where there is only one or it cannot be told
+std::vector<std::vector<int> > get_numa_nodes();
+
+// pin the calling thread to the given cpus, 0 on success
+int set_thread_affinity(const std::vector<int>& cpus);
+
+// threads owned by the engine instead of the openmp runtime
+// sessions that share a pool take turns instead of oversubscribing the cores, and decode and
+// prefill can run on separate pools pinned to separate cores
+class ThreadPool
+{
+public:
+    ThreadPool();
+    ~ThreadPool();
+
+    // num_threads counts the calling thread, which does its share of every job
+    // worker i is pinned to cpus[i % cpus.size()], empty cpus leaves the workers to the os
+    int create(int num_threads, const std::vector<int>& cpus = std::vector<int>());
+    void destroy();
+
+    int num_threads() const { return nthreads; }
+
+    // fn(begin, end, thread) over [0, n) in chunks of grain, thread is in [0, num_threads)
+    // every thread starts on its own slice and steals chunks from the slices of the others once it is done
+    // max_threads 0 uses all of them, calls from different threads take turns
+    void parallel_for(int n, int grain, const std::function<void(int, int, int)>& fn, int max_threads = 0);
+
+public:
+    // polls a worker spends on waiting for the next job before it sleeps, set before create
+    // spinning keeps the decode steps of one reply back to back, 0 sleeps right away and leaves the cores to others
+    int spin_count;
+    // numa node of the cpus the pool is pinned to, an index into get_numa_nodes()
+    // a model placed per node computes from the replica of that node, -1 for the first one
+    int numa_node;
+
+private:
+    ThreadPool(const ThreadPool&);
+    ThreadPool& operator=(const ThreadPool&);
+
+    void worker(int index, int cpu);
+    void run(int thread);
+
+    struct Slice
+    {
+        alignas(64) std::atomic<int> next;
+        int end;
+    };
+
+    // a worker is only woken for the jobs it takes part in, the others stay asleep
+    struct WorkerState
+    {
+        alignas(64) std::atomic<unsigned int> ticket;
+        bool sleeping;
+        std::condition_variable cond;
+    };
+
+private:
+    int nthreads;
+    std::vector<std::thread> workers;
+    std::unique_ptr<Slice[]> slices;
+    std::unique_ptr<WorkerState[]> states;
+
+    // one job at a time
+    std::mutex submit_lock;
+
+    std::mutex lock;
+    bool quit;
+    std::atomic<int> remaining;
+
+    // the current job
+    const std::function<void(int, int, int)>* job;
+    int job_threads;
+    int job_grain;
+};
+
+#endif // THREADPOOL_H
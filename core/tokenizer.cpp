@@ -0,0 +1,857 @@
+#include "tokenizer.h"
+
+#include "detokenizer.h"
+#include "utf8.h"
+
+#include <algorithm>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+// bert never splits words longer than this, they become [UNK]
+static const int max_input_chars_per_word = 100;
+
+// compiled tokenizer blob, native endian, every section starts 64 byte aligned
+// the runtime references the sections in place, nothing is parsed at load
+#define TOKENIZER_MAGIC 0x4b4f5447 // GTOK
+#define TOKENIZER_VERSION 1
+
+struct TokenizerHeader
+{
+    unsigned int magic;
+    unsigned int version;
+    unsigned int blob_size;
+
+    int vocab_size;
+    int trie_size;
+    int hash_nseed;
+    int hash_nslot;
+    int pool_size;
+
+    unsigned int bmp_offset;            // unsigned short[0x10000]
+    unsigned int trie_base_offset;      // int[trie_size]
+    unsigned int trie_check_offset;     // int[trie_size]
+    unsigned int hash_seeds_offset;     // unsigned int[hash_nseed]
+    unsigned int hash_slots_offset;     // int[hash_nslot]
+    unsigned int string_offsets_offset; // int[vocab_size + 1]
+    unsigned int string_pool_offset;    // char[pool_size]
+};
+
+class DoubleArrayTrieBuilder
+{
+public:
+    DoubleArrayTrieBuilder(const std::vector<std::string>& keys, const std::vector<int>& values, std::vector<int>& base, std::vector<int>& check);
+
+    int build();
+
+private:
+    int insert(int parent, int depth, int lo, int hi);
+    void resize(int size);
+
+private:
+    const std::vector<std::string>& keys;
+    const std::vector<int>& values;
+    std::vector<int> order;
+
+    std::vector<int>& base;
+    std::vector<int>& check;
+    std::vector<char> used_begin;
+    int next_check_pos;
+};
+
+DoubleArrayTrieBuilder::DoubleArrayTrieBuilder(const std::vector<std::string>& _keys, const std::vector<int>& _values, std::vector<int>& _base, std::vector<int>& _check)
+    : keys(_keys), values(_values), base(_base), check(_check)
+{
+    next_check_pos = 1;
+}
+
+int DoubleArrayTrieBuilder::build()
+{
+    base.clear();
+    check.clear();
+    used_begin.clear();
+    next_check_pos = 1;
+
+    order.resize(keys.size());
+    for (size_t i = 0; i < keys.size(); i++)
+        order[i] = (int)i;
+    std::sort(order.begin(), order.end(), [&](int a, int b) { return keys[a] < keys[b]; });
+
+    for (size_t i = 0; i < keys.size(); i++)
+    {
+        if (keys[order[i]].empty())
+            return -1;
+        if (i > 0 && keys[order[i]] == keys[order[i - 1]])
+            return -1;
+    }
+
+    resize(1024);
+    check[0] = 0;
+
+    int ret = keys.empty() ? 0 : insert(0, 0, 0, (int)keys.size());
+
+    // drop the unused tail
+    int size = (int)check.size();
+    while (size > 1 && check[size - 1] == -1)
+        size--;
+    base.resize(size);
+    check.resize(size);
+
+    return ret;
+}
+
+void DoubleArrayTrieBuilder::resize(int size)
+{
+    base.resize(size, 0);
+    check.resize(size, -1);
+    used_begin.resize(size, 0);
+}
+
+int DoubleArrayTrieBuilder::insert(int parent, int depth, int lo, int hi)
+{
+    // group the sorted keys in [lo, hi) by their code at depth
+    std::vector<int> codes;
+    std::vector<int> starts;
+    for (int i = lo; i < hi; i++)
+    {
+        const std::string& key = keys[order[i]];
+        int code = depth < (int)key.size() ? (unsigned char)key[depth] + 1 : 0;
+        if (codes.empty() || codes.back() != code)
+        {
+            codes.push_back(code);
+            starts.push_back(i);
+        }
+    }
+    starts.push_back(hi);
+
+    // find the first begin where every child slot is free
+    int pos = std::max(codes[0] + 1, next_check_pos) - 1;
+    int begin = 0;
+    bool first_free = true;
+    for (;;)
+    {
+        pos++;
+        if ((int)check.size() <= pos + 257)
+            resize((int)check.size() * 2 + 257);
+
+        if (check[pos] != -1)
+            continue;
+
+        if (first_free)
+        {
+            next_check_pos = pos;
+            first_free = false;
+        }
+
+        begin = pos - codes[0];
+        if (begin < 1 || used_begin[begin])
+            continue;
+
+        bool ok = true;
+        for (size_t j = 1; j < codes.size(); j++)
+        {
+            if (check[begin + codes[j]] != -1)
+            {
+                ok = false;
+                break;
+            }
+        }
+        if (ok)
+            break;
+    }
+
+    used_begin[begin] = 1;
+    base[parent] = begin;
+    for (size_t j = 0; j < codes.size(); j++)
+        check[begin + codes[j]] = parent;
+
+    for (size_t j = 0; j < codes.size(); j++)
+    {
+        int node = begin + codes[j];
+        if (codes[j] == 0)
+        {
+            // leaf, store the value as a negative base
+            base[node] = -values[order[starts[j]]] - 1;
+            continue;
+        }
+
+        int ret = insert(node, depth + 1, starts[j], starts[j + 1]);
+        if (ret != 0)
+            return ret;
+    }
+
+    return 0;
+}
+
+DoubleArrayTrie::DoubleArrayTrie()
+{
+    base = 0;
+    check = 0;
+    size = 0;
+}
+
+int DoubleArrayTrie::build(const std::vector<std::string>& keys, const std::vector<int>& values, std::vector<int>& base, std::vector<int>& check)
+{
+    DoubleArrayTrieBuilder builder(keys, values, base, check);
+    return builder.build();
+}
+
+void DoubleArrayTrie::attach(const int* _base, const int* _check, int _size)
+{
+    base = _base;
+    check = _check;
+    size = _size;
+}
+
+int DoubleArrayTrie::traverse(int node, const char* key, int len) const
+{
+    for (int i = 0; i < len; i++)
+    {
+        int t = base[node] + (unsigned char)key[i] + 1;
+        if (base[node] <= 0 || t >= size || check[t] != node)
+            return -1;
+        node = t;
+    }
+    return node;
+}
+
+int DoubleArrayTrie::value(int node) const
+{
+    int t = base[node];
+    if (t <= 0 || t >= size || check[t] != node)
+        return -1;
+    return -base[t] - 1;
+}
+
+int DoubleArrayTrie::longest_match(int node, const char* str, int len, int* matched) const
+{
+    int v = -1;
+    for (int i = 0; i < len; i++)
+    {
+        node = traverse(node, str + i, 1);
+        if (node < 0)
+            break;
+
+        int nv = value(node);
+        if (nv >= 0)
+        {
+            v = nv;
+            *matched = i + 1;
+        }
+    }
+    return v;
+}
+
+static unsigned int hash_bytes(const char* s, size_t len, unsigned int seed)
+{
+    // fnv-1a with a murmur3 finalizer
+    unsigned int h = 2166136261u ^ (seed * 0x9e3779b9u);
+    for (size_t i = 0; i < len; i++)
+    {
+        h ^= (unsigned char)s[i];
+        h *= 16777619u;
+    }
+    h ^= h >> 16;
+    h *= 0x85ebca6bu;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35u;
+    h ^= h >> 16;
+    return h;
+}
+
+PerfectHash::PerfectHash()
+{
+    seeds = 0;
+    nseed = 0;
+    slots = 0;
+    nslot = 0;
+}
+
+int PerfectHash::build(const std::vector<std::string>& keys, const std::vector<int>& values, std::vector<unsigned int>& seeds, std::vector<int>& slots)
+{
+    const int n = (int)keys.size();
+    const int nbucket = std::max(1, n / 4);
+    const int nslot = n + n / 4 + 1;
+
+    seeds.assign(nbucket, 0);
+    slots.assign(nslot, -1);
+
+    std::vector<std::vector<int> > buckets(nbucket);
+    for (int i = 0; i < n; i++)
+        buckets[hash_bytes(keys[i].data(), keys[i].size(), 0) % nbucket].push_back(i);
+
+    // place the crowded buckets first while the table is still empty
+    std::vector<int> order(nbucket);
+    for (int i = 0; i < nbucket; i++)
+        order[i] = i;
+    std::stable_sort(order.begin(), order.end(), [&](int a, int b) { return buckets[a].size() > buckets[b].size(); });
+
+    std::vector<int> pos;
+    for (int i = 0; i < nbucket; i++)
+    {
+        const std::vector<int>& bucket = buckets[order[i]];
+        if (bucket.empty())
+            break;
+
+        unsigned int seed = 1;
+        for (; seed < (1u << 20); seed++)
+        {
+            pos.clear();
+            bool ok = true;
+            for (size_t j = 0; j < bucket.size() && ok; j++)
+            {
+                int q = hash_bytes(keys[bucket[j]].data(), keys[bucket[j]].size(), seed) % nslot;
+                if (slots[q] != -1 || std::find(pos.begin(), pos.end(), q) != pos.end())
+                    ok = false;
+                pos.push_back(q);
+            }
+            if (ok)
+                break;
+        }
+        if (seed == (1u << 20))
+            return -1;
+
+        seeds[order[i]] = seed;
+        for (size_t j = 0; j < bucket.size(); j++)
+            slots[pos[j]] = values[bucket[j]];
+    }
+
+    return 0;
+}
+
+void PerfectHash::attach(const unsigned int* _seeds, int _nseed, const int* _slots, int _nslot)
+{
+    seeds = _seeds;
+    nseed = _nseed;
+    slots = _slots;
+    nslot = _nslot;
+}
+
+int PerfectHash::lookup(std::string_view key) const
+{
+    if (nseed == 0 || nslot == 0)
+        return -1;
+
+    unsigned int seed = seeds[hash_bytes(key.data(), key.size(), 0) % nseed];
+    if (seed == 0)
+        return -1;
+
+    return slots[hash_bytes(key.data(), key.size(), seed) % nslot];
+}
+
+static bool is_whitespace(unsigned int c)
+{
+    if (c == ' ' || c == '\t' || c == '\n' || c == '\r')
+        return true;
+
+    // unicode Zs
+    return c == 0x00a0 || c == 0x1680 || (c >= 0x2000 && c <= 0x200a) || c == 0x202f || c == 0x205f || c == 0x3000;
+}
+
+static bool is_control(unsigned int c)
+{
+    if (c == '\t' || c == '\n' || c == '\r')
+        return false;
+
+    // unicode Cc and the common Cf
+    return c < 0x20 || (c >= 0x7f && c <= 0x9f) || c == 0x00ad || (c >= 0x200b && c <= 0x200f) || (c >= 0x202a && c <= 0x202e) || (c >= 0x2060 && c <= 0x2064) || c == 0xfeff;
+}
+
+static bool is_chinese_char(unsigned int c)
+{
+    return (c >= 0x4e00 && c <= 0x9fff)
+           || (c >= 0x3400 && c <= 0x4dbf)
+           || (c >= 0x20000 && c <= 0x2a6df)
+           || (c >= 0x2a700 && c <= 0x2b73f)
+           || (c >= 0x2b740 && c <= 0x2b81f)
+           || (c >= 0x2b820 && c <= 0x2ceaf)
+           || (c >= 0xf900 && c <= 0xfaff)
+           || (c >= 0x2f800 && c <= 0x2fa1f);
+}
+
+static bool is_punctuation(unsigned int c)
+{
+    // bert treats every non-alphanumeric ascii as punctuation
+    if ((c >= 33 && c <= 47) || (c >= 58 && c <= 64) || (c >= 91 && c <= 96) || (c >= 123 && c <= 126))
+        return true;
+
+    // unicode P*, the blocks that show up in chinese chat
+    return c == 0x00a1 || c == 0x00a7 || c == 0x00ab || c == 0x00b6 || c == 0x00b7 || c == 0x00bb || c == 0x00bf
+           || (c >= 0x2010 && c <= 0x2027)
+           || (c >= 0x2030 && c <= 0x205e)
+           || (c >= 0x3001 && c <= 0x3003)
+           || (c >= 0x3008 && c <= 0x3011)
+           || (c >= 0x3014 && c <= 0x301f)
+           || c == 0x30fb
+           || (c >= 0xfe10 && c <= 0xfe19)
+           || (c >= 0xfe30 && c <= 0xfe6b)
+           || (c >= 0xff01 && c <= 0xff0f)
+           || (c >= 0xff1a && c <= 0xff20)
+           || (c >= 0xff3b && c <= 0xff40)
+           || (c >= 0xff5b && c <= 0xff65);
+}
+
+// lowercase and strip accents, covers latin-1, greek, cyrillic and fullwidth latin
+static unsigned int normalize_char(unsigned int c)
+{
+    if (c >= 'A' && c <= 'Z')
+        return c + 32;
+
+    if (c < 0xc0)
+        return c;
+
+    if (c <= 0xff)
+    {
+        if (c <= 0xde && c != 0xd7)
+            c += 32;
+
+        // nfd base letters of U+00E0 .. U+00FF, 0 keeps the char
+        static const char base_letters[32] = {
+            'a', 'a', 'a', 'a', 'a', 'a', 0, 'c', 'e', 'e', 'e', 'e', 'i', 'i', 'i', 'i',
+            0, 'n', 'o', 'o', 'o', 'o', 'o', 0, 0, 'u', 'u', 'u', 'u', 'y', 0, 'y'
+        };
+        if (c >= 0xe0 && base_letters[c - 0xe0])
+            return base_letters[c - 0xe0];
+        return c;
+    }
+
+    if (c >= 0x391 && c <= 0x3a9 && c != 0x3a2)
+        return c + 32;
+    if (c >= 0x410 && c <= 0x42f)
+        return c + 32;
+    if (c >= 0x400 && c <= 0x40f)
+        return c + 80;
+    if (c >= 0xff21 && c <= 0xff3a)
+        return c + 32;
+
+    return c;
+}
+
+Tokenizer::Tokenizer()
+{
+    pad_id = 0;
+    unk_id = 100;
+    cls_id = 101;
+    sep_id = 102;
+    continuation_node = -1;
+    bmp_table = 0;
+    string_pool = 0;
+    string_offsets = 0;
+    nvocab = 0;
+}
+
+static size_t align_size(size_t sz, size_t n)
+{
+    return (sz + n - 1) & -n;
+}
+
+int Tokenizer::compile(const char* vocab, size_t size, std::vector<unsigned char>& out)
+{
+    if (!utf8_validate(std::string_view(vocab, size)))
+    {
+        fprintf(stderr, "vocab is not valid utf-8\n");
+        return -1;
+    }
+
+    std::vector<std::string> tokens;
+    size_t start = 0;
+    while (start < size)
+    {
+        const char* end = (const char*)memchr(vocab + start, '\n', size - start);
+        size_t len = (end ? end - vocab : size) - start;
+        size_t next = start + len + 1;
+        if (len > 0 && vocab[start + len - 1] == '\r')
+            len--;
+        tokens.push_back(std::string(vocab + start, len));
+        start = next;
+    }
+
+    const int n = (int)tokens.size();
+    if (n == 0 || n >= 0xffff)
+    {
+        fprintf(stderr, "invalid vocab size %d\n", n);
+        return -1;
+    }
+
+    // duplicated lines resolve to the last id like bert load_vocab
+    std::vector<std::string> keys;
+    std::vector<int> values;
+    {
+        std::vector<int> order(n);
+        for (int i = 0; i < n; i++)
+            order[i] = i;
+        std::stable_sort(order.begin(), order.end(), [&](int a, int b) { return tokens[a] < tokens[b]; });
+
+        for (int i = 0; i < n; i++)
+        {
+            const std::string& token = tokens[order[i]];
+            if (token.empty())
+                continue;
+            if (i + 1 < n && tokens[order[i + 1]] == token)
+                continue;
+            keys.push_back(token);
+            values.push_back(order[i]);
+        }
+    }
+
+    std::vector<int> trie_base;
+    std::vector<int> trie_check;
+    if (DoubleArrayTrie::build(keys, values, trie_base, trie_check) != 0)
+    {
+        fprintf(stderr, "build vocab trie failed\n");
+        return -1;
+    }
+
+    std::vector<unsigned int> hash_seeds;
+    std::vector<int> hash_slots;
+    if (PerfectHash::build(keys, values, hash_seeds, hash_slots) != 0)
+    {
+        fprintf(stderr, "build vocab hash failed\n");
+        return -1;
+    }
+
+    std::vector<unsigned short> bmp(0x10000, 0xffff);
+    for (size_t i = 0; i < keys.size(); i++)
+    {
+        size_t pos = 0;
+        unsigned int c = utf8_decode(keys[i], pos);
+        if (pos == keys[i].size() && c < 0x10000)
+            bmp[c] = (unsigned short)values[i];
+    }
+
+    std::vector<int> string_offsets(n + 1);
+    std::string string_pool;
+    for (int i = 0; i < n; i++)
+    {
+        string_offsets[i] = (int)string_pool.size();
+        string_pool += tokens[i];
+    }
+    string_offsets[n] = (int)string_pool.size();
+
+    TokenizerHeader header;
+    memset(&header, 0, sizeof(header));
+    header.magic = TOKENIZER_MAGIC;
+    header.version = TOKENIZER_VERSION;
+    header.vocab_size = n;
+    header.trie_size = (int)trie_base.size();
+    header.hash_nseed = (int)hash_seeds.size();
+    header.hash_nslot = (int)hash_slots.size();
+    header.pool_size = (int)string_pool.size();
+
+    size_t offset = align_size(sizeof(header), 64);
+    header.bmp_offset = (unsigned int)offset;
+    offset = align_size(offset + bmp.size() * sizeof(unsigned short), 64);
+    header.trie_base_offset = (unsigned int)offset;
+    offset = align_size(offset + trie_base.size() * sizeof(int), 64);
+    header.trie_check_offset = (unsigned int)offset;
+    offset = align_size(offset + trie_check.size() * sizeof(int), 64);
+    header.hash_seeds_offset = (unsigned int)offset;
+    offset = align_size(offset + hash_seeds.size() * sizeof(unsigned int), 64);
+    header.hash_slots_offset = (unsigned int)offset;
+    offset = align_size(offset + hash_slots.size() * sizeof(int), 64);
+    header.string_offsets_offset = (unsigned int)offset;
+    offset = align_size(offset + string_offsets.size() * sizeof(int), 64);
+    header.string_pool_offset = (unsigned int)offset;
+    offset = align_size(offset + string_pool.size(), 64);
+    header.blob_size = (unsigned int)offset;
+
+    out.assign(offset, 0);
+    memcpy(out.data(), &header, sizeof(header));
+    memcpy(out.data() + header.bmp_offset, bmp.data(), bmp.size() * sizeof(unsigned short));
+    memcpy(out.data() + header.trie_base_offset, trie_base.data(), trie_base.size() * sizeof(int));
+    memcpy(out.data() + header.trie_check_offset, trie_check.data(), trie_check.size() * sizeof(int));
+    memcpy(out.data() + header.hash_seeds_offset, hash_seeds.data(), hash_seeds.size() * sizeof(unsigned int));
+    memcpy(out.data() + header.hash_slots_offset, hash_slots.data(), hash_slots.size() * sizeof(int));
+    memcpy(out.data() + header.string_offsets_offset, string_offsets.data(), string_offsets.size() * sizeof(int));
+    memcpy(out.data() + header.string_pool_offset, string_pool.data(), string_pool.size());
+
+    return 0;
+}
+
+int Tokenizer::load(const char* path)
+{
+    file.close();
+    if (file.open(path) != 0)
+        return -1;
+
+    int ret = load(file.data(), file.size());
+
+    // vocab.txt has been compiled into blob
+    if (!blob.empty())
+        file.close();
+
+    return ret;
+}
+
+#if __ANDROID_API__ >= 9
+int Tokenizer::load(AAssetManager* mgr, const char* assetpath)
+{
+    file.close();
+    if (file.open(mgr, assetpath) != 0)
+        return -1;
+
+    int ret = load(file.data(), file.size());
+
+    if (!blob.empty())
+        file.close();
+
+    return ret;
+}
+#endif
+
+int Tokenizer::load(const unsigned char* mem, size_t size)
+{
+    if (size < sizeof(TokenizerHeader) || ((const TokenizerHeader*)mem)->magic != TOKENIZER_MAGIC)
+    {
+        std::vector<unsigned char> compiled;
+        if (compile((const char*)mem, size, compiled) != 0)
+            return -1;
+        blob.swap(compiled);
+        mem = blob.data();
+        size = blob.size();
+    }
+    else if ((uintptr_t)mem % sizeof(int) != 0)
+    {
+        // apk assets are only guaranteed 4 byte aligned by zipalign, copy anything worse
+        blob.assign(mem, mem + size);
+        mem = blob.data();
+    }
+    else
+    {
+        blob.clear();
+    }
+
+    const TokenizerHeader* header = (const TokenizerHeader*)mem;
+    if (header->version != TOKENIZER_VERSION || header->blob_size > size)
+    {
+        fprintf(stderr, "tokenizer blob version %u size %u mismatch\n", header->version, header->blob_size);
+        return -1;
+    }
+
+    // every section must lie inside the blob
+    struct
+    {
+        unsigned int offset;
+        size_t size;
+    } sections[] = {
+        {header->bmp_offset, 0x10000 * sizeof(unsigned short)},
+        {header->trie_base_offset, (size_t)header->trie_size * sizeof(int)},
+        {header->trie_check_offset, (size_t)header->trie_size * sizeof(int)},
+        {header->hash_seeds_offset, (size_t)header->hash_nseed * sizeof(unsigned int)},
+        {header->hash_slots_offset, (size_t)header->hash_nslot * sizeof(int)},
+        {header->string_offsets_offset, ((size_t)header->vocab_size + 1) * sizeof(int)},
+        {header->string_pool_offset, (size_t)header->pool_size},
+    };
+    if (header->vocab_size <= 0 || header->trie_size <= 0 || header->hash_nseed <= 0 || header->hash_nslot <= 0 || header->pool_size < 0)
+        return -1;
+    for (size_t i = 0; i < sizeof(sections) / sizeof(sections[0]); i++)
+    {
+        if (sections[i].offset % sizeof(int) != 0 || sections[i].offset > header->blob_size || sections[i].size > header->blob_size - sections[i].offset)
+        {
+            fprintf(stderr, "tokenizer blob section %d out of range\n", (int)i);
+            return -1;
+        }
+    }
+
+    const int* offsets = (const int*)(mem + header->string_offsets_offset);
+    for (int i = 0; i < header->vocab_size; i++)
+    {
+        if (offsets[i] < 0 || offsets[i] > offsets[i + 1])
+            return -1;
+    }
+    if (offsets[header->vocab_size] != header->pool_size)
+        return -1;
+
+    bmp_table = (const unsigned short*)(mem + header->bmp_offset);
+    trie.attach((const int*)(mem + header->trie_base_offset), (const int*)(mem + header->trie_check_offset), header->trie_size);
+    hash.attach((const unsigned int*)(mem + header->hash_seeds_offset), header->hash_nseed, (const int*)(mem + header->hash_slots_offset), header->hash_nslot);
+    string_offsets = (const int*)(mem + header->string_offsets_offset);
+    string_pool = (const char*)(mem + header->string_pool_offset);
+    nvocab = header->vocab_size;
+
+    continuation_node = trie.traverse(trie.root(), "##", 2);
+
+    int id;
+    if ((id = token_to_id("[PAD]")) >= 0)
+        pad_id = id;
+    if ((id = token_to_id("[UNK]")) >= 0)
+        unk_id = id;
+    if ((id = token_to_id("[CLS]")) >= 0)
+        cls_id = id;
+    if ((id = token_to_id("[SEP]")) >= 0)
+        sep_id = id;
+
+    return 0;
+}
+
+int Tokenizer::token_to_id(std::string_view token) const
+{
+    int id = hash.lookup(token);
+    if (id < 0 || id >= nvocab || id_to_token(id) != token)
+        return -1;
+    return id;
+}
+
+std::string_view Tokenizer::id_to_token(int id) const
+{
+    if (id < 0 || id >= nvocab)
+        id = unk_id;
+    if (id < 0 || id >= nvocab)
+        return std::string_view();
+    return std::string_view(string_pool + string_offsets[id], string_offsets[id + 1] - string_offsets[id]);
+}
+
+int Tokenizer::single_char(unsigned int c, const char* utf8, int len) const
+{
+    if (c < 0x10000)
+    {
+        int id = bmp_table[c];
+        return id >= nvocab ? unk_id : id;
+    }
+
+    int id = token_to_id(std::string_view(utf8, len));
+    return id < 0 ? unk_id : id;
+}
+
+int Tokenizer::wordpiece(const char* word, int len, int nchars, int* ids, int max_ids) const
+{
+    if (len == 0 || max_ids <= 0)
+        return 0;
+
+    if (nchars > max_input_chars_per_word)
+    {
+        ids[0] = unk_id;
+        return 1;
+    }
+
+    // most english words and numbers are whole vocab entries
+    int id = token_to_id(std::string_view(word, len));
+    if (id >= 0)
+    {
+        ids[0] = id;
+        return 1;
+    }
+
+    int count = 0;
+    int start = 0;
+    while (start < len)
+    {
+        int node = start == 0 ? trie.root() : continuation_node;
+        int matched = 0;
+        id = node < 0 ? -1 : trie.longest_match(node, word + start, len - start, &matched);
+        if (id < 0 || id >= nvocab)
+        {
+            // any unmatched piece turns the whole word into [UNK]
+            ids[0] = unk_id;
+            return 1;
+        }
+
+        if (count == max_ids)
+            return count;
+
+        ids[count++] = id;
+        start += matched;
+    }
+
+    return count;
+}
+
+int Tokenizer::encode(std::string_view text, int* ids, int max_ids) const
+{
+    int count = 0;
+
+    // lowercased word, bytes beyond max_input_chars_per_word are dropped since the word becomes [UNK] anyway
+    char word[max_input_chars_per_word * 4 + 4];
+    int wordlen = 0;
+    int nchars = 0;
+
+    size_t pos = 0;
+    while (pos < text.size() && count < max_ids)
+    {
+        // ascii run, no decoding and no cjk or accent handling needed
+        const size_t end = pos + utf8_ascii_prefix(text.data() + pos, text.size() - pos);
+        for (; pos < end && count < max_ids; pos++)
+        {
+            char c = text[pos];
+            if (c == 0 || is_control(c))
+                continue;
+
+            if (is_whitespace(c) || is_punctuation(c))
+            {
+                count += wordpiece(word, wordlen, nchars, ids + count, max_ids - count);
+                wordlen = 0;
+                nchars = 0;
+
+                if (!is_whitespace(c) && count < max_ids)
+                {
+                    int id = bmp_table[(unsigned char)c];
+                    ids[count++] = id >= nvocab ? unk_id : id;
+                }
+                continue;
+            }
+
+            if (nchars < max_input_chars_per_word + 1)
+                word[wordlen++] = (char)normalize_char(c);
+            nchars++;
+        }
+
+        if (pos == text.size() || count == max_ids)
+            break;
+
+        unsigned int c = utf8_decode(text, pos);
+
+        if (c == 0xfffd || is_control(c))
+            continue;
+
+        if (is_whitespace(c))
+        {
+            count += wordpiece(word, wordlen, nchars, ids + count, max_ids - count);
+            wordlen = 0;
+            nchars = 0;
+            continue;
+        }
+
+        c = normalize_char(c);
+
+        if (is_chinese_char(c) || is_punctuation(c))
+        {
+            count += wordpiece(word, wordlen, nchars, ids + count, max_ids - count);
+            wordlen = 0;
+            nchars = 0;
+
+            if (count < max_ids)
+            {
+                char single[4];
+                ids[count++] = single_char(c, single, utf8_encode(c, single));
+            }
+            continue;
+        }
+
+        if (nchars < max_input_chars_per_word + 1)
+            wordlen += utf8_encode(c, word + wordlen);
+        nchars++;
+    }
+
+    if (count < max_ids)
+        count += wordpiece(word, wordlen, nchars, ids + count, max_ids - count);
+
+    return count;
+}
+
+std::vector<int> Tokenizer::encode(std::string_view text) const
+{
+    // every id consumes at least one byte of text
+    std::vector<int> ids(text.size());
+    ids.resize(encode(text, ids.data(), (int)ids.size()));
+    return ids;
+}
+
+std::string Tokenizer::decode(const std::vector<int>& ids) const
+{
+    Detokenizer detokenizer(*this);
+
+    std::string text;
+    for (size_t i = 0; i < ids.size(); i++)
+        text += detokenizer.push(ids[i]);
+    return text;
+}
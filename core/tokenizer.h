@@ -0,0 +1,130 @@
+#ifndef TOKENIZER_H
+#define TOKENIZER_H
+
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "mappedfile.h"
+
+// double-array trie over the utf-8 bytes of the vocab entries
+// byte b is stored as code b + 1, code 0 marks the end of a key
+class DoubleArrayTrie
+{
+public:
+    DoubleArrayTrie();
+
+    // keys must be unique
+    static int build(const std::vector<std::string>& keys, const std::vector<int>& values, std::vector<int>& base, std::vector<int>& check);
+
+    // the arrays are referenced, not copied
+    void attach(const int* base, const int* check, int size);
+
+    // walk len bytes from node, return the reached node or -1
+    int traverse(int node, const char* key, int len) const;
+
+    // value of the key ending at node, -1 if no key ends there
+    int value(int node) const;
+
+    // longest non-empty key reachable from node that is a prefix of str
+    // return its value and store its byte length in matched, -1 if none
+    int longest_match(int node, const char* str, int len, int* matched) const;
+
+    int root() const { return 0; }
+
+private:
+    const int* base;
+    const int* check;
+    int size;
+};
+
+// hash and displace perfect hash, every key gets its own slot
+class PerfectHash
+{
+public:
+    PerfectHash();
+
+    // keys must be unique
+    static int build(const std::vector<std::string>& keys, const std::vector<int>& values, std::vector<unsigned int>& seeds, std::vector<int>& slots);
+
+    // the arrays are referenced, not copied
+    void attach(const unsigned int* seeds, int nseed, const int* slots, int nslot);
+
+    // value in the slot key maps to, -1 if empty
+    // foreign keys land on some other key's slot, the caller compares the key
+    int lookup(std::string_view key) const;
+
+private:
+    const unsigned int* seeds;
+    int nseed;
+    const int* slots;
+    int nslot;
+};
+
+// bert style tokenizer as used by GPT2-chitchat (BertTokenizerFast with do_lower_case)
+// BasicTokenizer splits on whitespace, punctuation and cjk characters,
+// then every word is split into vocab pieces by greedy longest-match WordPiece
+// all tables live in one flat blob, compiled from vocab.txt once by tools/vocab2bin
+// and memory mapped at startup, encode and decode are const and safe to share between threads
+class Tokenizer
+{
+public:
+    Tokenizer();
+
+    // compiled blob or plain vocab.txt, the latter is compiled in memory
+    int load(const char* path);
+#if __ANDROID_API__ >= 9
+    int load(AAssetManager* mgr, const char* assetpath);
+#endif
+    // mem must stay valid while the tokenizer is used, unless it is vocab.txt
+    int load(const unsigned char* mem, size_t size);
+
+    // vocab.txt, one token per line, the line number is the token id
+    static int compile(const char* vocab, size_t size, std::vector<unsigned char>& blob);
+
+    // write at most max_ids ids, return the count
+    // never allocates, text.size() ids is always enough
+    int encode(std::string_view text, int* ids, int max_ids) const;
+    std::vector<int> encode(std::string_view text) const;
+    // whole reply at once, see Detokenizer for streaming
+    std::string decode(const std::vector<int>& ids) const;
+
+    int vocab_size() const { return nvocab; }
+
+    // exact lookup, -1 if token is not in vocab
+    int token_to_id(std::string_view token) const;
+    std::string_view id_to_token(int id) const;
+
+public:
+    int pad_id;
+    int unk_id;
+    int cls_id;
+    int sep_id;
+
+private:
+    Tokenizer(const Tokenizer&);
+    Tokenizer& operator=(const Tokenizer&);
+
+    int single_char(unsigned int c, const char* utf8, int len) const;
+    int wordpiece(const char* word, int len, int nchars, int* ids, int max_ids) const;
+
+private:
+    DoubleArrayTrie trie;
+    int continuation_node;
+
+    PerfectHash hash;
+
+    // bmp code point -> id of the single char token, 0xffff if none
+    const unsigned short* bmp_table;
+
+    // id -> text, token i is string_pool[string_offsets[i] .. string_offsets[i + 1])
+    const char* string_pool;
+    const int* string_offsets;
+    int nvocab;
+
+    // backing storage of the tables
+    MappedFile file;
+    std::vector<unsigned char> blob;
+};
+
+#endif // TOKENIZER_H
@@ -0,0 +1,135 @@
+#include "utf8.h"
+
+#if __SSE2__ || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define UTF8_SSE2 1
+#elif __ARM_NEON
+#include <arm_neon.h>
+#define UTF8_NEON 1
+#endif
+
+size_t utf8_ascii_prefix(const char* s, size_t len)
+{
+    size_t i = 0;
+
+#if UTF8_SSE2
+    for (; i + 16 <= len; i += 16)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i*)(s + i));
+        int mask = _mm_movemask_epi8(v);
+        if (mask)
+        {
+            int j = 0;
+            while (!(mask & 1))
+            {
+                mask >>= 1;
+                j++;
+            }
+            return i + j;
+        }
+    }
+#elif UTF8_NEON
+    for (; i + 16 <= len; i += 16)
+    {
+        uint64x2_t v = vreinterpretq_u64_u8(vld1q_u8((const unsigned char*)s + i));
+        if ((vgetq_lane_u64(v, 0) | vgetq_lane_u64(v, 1)) & 0x8080808080808080ull)
+            break;
+    }
+#endif
+
+    for (; i < len; i++)
+    {
+        if ((unsigned char)s[i] >= 0x80)
+            break;
+    }
+
+    return i;
+}
+
+bool utf8_validate(std::string_view s)
+{
+    size_t pos = 0;
+    while (pos < s.size())
+    {
+        pos += utf8_ascii_prefix(s.data() + pos, s.size() - pos);
+        if (pos == s.size())
+            break;
+
+        // U+FFFD itself is valid, tell it apart from the error value by its length
+        size_t start = pos;
+        unsigned int c = utf8_decode(s, pos);
+        if (c == 0xfffd && pos - start != 3)
+            return false;
+    }
+    return true;
+}
+
+size_t utf16_to_utf8(const char16_t* src, size_t len, char* dst)
+{
+    size_t outlen = 0;
+    size_t i = 0;
+    while (i < len)
+    {
+        // ascii run
+        while (i < len && src[i] < 0x80)
+            dst[outlen++] = (char)src[i++];
+        if (i == len)
+            break;
+
+        unsigned int c = src[i++];
+        if (c >= 0xd800 && c <= 0xdbff && i < len && src[i] >= 0xdc00 && src[i] <= 0xdfff)
+        {
+            c = 0x10000 + ((c - 0xd800) << 10) + (src[i] - 0xdc00);
+            i++;
+        }
+        else if (c >= 0xd800 && c <= 0xdfff)
+        {
+            c = 0xfffd;
+        }
+
+        outlen += utf8_encode(c, dst + outlen);
+    }
+    return outlen;
+}
+
+size_t utf8_to_utf16(std::string_view src, char16_t* dst)
+{
+    size_t outlen = 0;
+    size_t pos = 0;
+    while (pos < src.size())
+    {
+        size_t n = utf8_ascii_prefix(src.data() + pos, src.size() - pos);
+        for (size_t i = 0; i < n; i++)
+            dst[outlen++] = (unsigned char)src[pos + i];
+        pos += n;
+        if (pos == src.size())
+            break;
+
+        unsigned int c = utf8_decode(src, pos);
+        if (c >= 0x10000)
+        {
+            c -= 0x10000;
+            dst[outlen++] = (char16_t)(0xd800 + (c >> 10));
+            dst[outlen++] = (char16_t)(0xdc00 + (c & 0x3ff));
+        }
+        else
+        {
+            dst[outlen++] = (char16_t)c;
+        }
+    }
+    return outlen;
+}
+
+std::string utf16_to_utf8(std::u16string_view src)
+{
+    std::string dst(src.size() * 3, '\0');
+    dst.resize(utf16_to_utf8(src.data(), src.size(), &dst[0]));
+    return dst;
+}
+
+std::u16string utf8_to_utf16(std::string_view src)
+{
+    std::u16string dst(src.size(), u'\0');
+    dst.resize(utf8_to_utf16(src, &dst[0]));
+    return dst;
+}
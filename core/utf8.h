@@ -0,0 +1,118 @@
+#ifndef UTF8_H
+#define UTF8_H
+
+#include <stddef.h>
+#include <string>
+#include <string_view>
+
+// length of the leading run of ascii bytes, 16 bytes per step with sse2 or neon
+size_t utf8_ascii_prefix(const char* s, size_t len);
+
+// strict utf-8, rejects overlong forms, surrogates and code points above U+10FFFF
+bool utf8_validate(std::string_view s);
+
+// decode the code point at s[pos] and advance pos
+// an invalid or truncated sequence gives U+FFFD and advances one byte
+inline unsigned int utf8_decode(std::string_view s, size_t& pos)
+{
+    const unsigned char* p = (const unsigned char*)s.data() + pos;
+    const size_t avail = s.size() - pos;
+
+    unsigned int c = p[0];
+    if (c < 0x80)
+    {
+        pos += 1;
+        return c;
+    }
+
+    size_t count;
+    unsigned int min;
+    if ((c & 0xe0) == 0xc0)
+    {
+        count = 1;
+        c &= 0x1f;
+        min = 0x80;
+    }
+    else if ((c & 0xf0) == 0xe0)
+    {
+        count = 2;
+        c &= 0x0f;
+        min = 0x800;
+    }
+    else if ((c & 0xf8) == 0xf0)
+    {
+        count = 3;
+        c &= 0x07;
+        min = 0x10000;
+    }
+    else
+    {
+        pos += 1;
+        return 0xfffd;
+    }
+
+    if (count >= avail)
+    {
+        pos += 1;
+        return 0xfffd;
+    }
+
+    for (size_t i = 1; i <= count; i++)
+    {
+        if ((p[i] & 0xc0) != 0x80)
+        {
+            pos += 1;
+            return 0xfffd;
+        }
+        c = (c << 6) | (p[i] & 0x3f);
+    }
+
+    if (c < min || c > 0x10ffff || (c >= 0xd800 && c <= 0xdfff))
+    {
+        pos += 1;
+        return 0xfffd;
+    }
+
+    pos += count + 1;
+    return c;
+}
+
+// encode one code point into out, which must hold 4 bytes, return the byte count
+inline int utf8_encode(unsigned int c, char* out)
+{
+    if (c < 0x80)
+    {
+        out[0] = (char)c;
+        return 1;
+    }
+    if (c < 0x800)
+    {
+        out[0] = (char)(0xc0 | (c >> 6));
+        out[1] = (char)(0x80 | (c & 0x3f));
+        return 2;
+    }
+    if (c < 0x10000)
+    {
+        out[0] = (char)(0xe0 | (c >> 12));
+        out[1] = (char)(0x80 | ((c >> 6) & 0x3f));
+        out[2] = (char)(0x80 | (c & 0x3f));
+        return 3;
+    }
+    out[0] = (char)(0xf0 | (c >> 18));
+    out[1] = (char)(0x80 | ((c >> 12) & 0x3f));
+    out[2] = (char)(0x80 | ((c >> 6) & 0x3f));
+    out[3] = (char)(0x80 | (c & 0x3f));
+    return 4;
+}
+
+// utf-16 <-> utf-8 for the platform string types (jstring, windows console)
+// unpaired surrogates and invalid bytes become U+FFFD
+// dst must hold len * 3 bytes, return the bytes written
+size_t utf16_to_utf8(const char16_t* src, size_t len, char* dst);
+// dst must hold src.size() units, return the units written
+size_t utf8_to_utf16(std::string_view src, char16_t* dst);
+
+std::string utf16_to_utf8(std::u16string_view src);
+std::u16string utf8_to_utf16(std::string_view src);
+
+#endif // UTF8_H
@@ -0,0 +1,684 @@
+// generate the replies of a jsonl file of conversations, many at once on all cores
+//
+// cmake --build build --target gpt2batch, or
+// g++ -O2 -march=native -std=c++17 -Icore tools/gpt2batch.cpp core/*.cpp -lpthread -o gpt2batch
+// ./gpt2batch assert conversations.jsonl results.jsonl -sessions 32 -seed 1
+//
+// a line is {"id": any, "turns": ["user", ...]}, {"messages": [{"role": "user", "content": ...}, ...]},
+// {"prompt": "user"} or just "user", with optional "seed" and "max_len"
+// every user turn gets a generated reply, which is the history of the next turn like in the chat demo
+// a result line is written as soon as its conversation is done, in the order they finish:
+// {"line": n, "id": ..., "status": "done", "replies": [...], "turns": [{"first_ms", "ms", "tokens"}, ...], "ms"}
+// with -seed every line samples from seed + its line number, the results do not depend on the sharding
+// the exit code is 1 if any conversation failed, every other line still gets its result
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "gpt2_api.h"
+#include "utf8.h"
+
+typedef std::chrono::steady_clock Clock;
+
+static double ms_since(Clock::time_point start, Clock::time_point end = Clock::now())
+{
+    return std::chrono::duration<double, std::milli>(end - start).count();
+}
+
+// just enough json for the input lines
+struct JsonValue
+{
+    enum
+    {
+        NONE,
+        STRING,
+        NUMBER,
+        ARRAY,
+        OBJECT,
+        OTHER
+    };
+
+    int type;
+    std::string str; // the text of a string, the source text of anything else
+    double number;
+    std::vector<JsonValue> items;
+    std::vector<std::string> keys; // of an object, items hold the values
+
+    JsonValue()
+    {
+        type = NONE;
+        number = 0;
+    }
+
+    const JsonValue* get(const char* key) const
+    {
+        for (size_t i = 0; i < keys.size(); i++)
+        {
+            if (keys[i] == key)
+                return &items[i];
+        }
+        return 0;
+    }
+};
+
+class JsonParser
+{
+public:
+    JsonParser(const std::string& _text)
+        : text(_text)
+    {
+        pos = 0;
+    }
+
+    int parse(JsonValue& value)
+    {
+        if (parse_value(value, 0) != 0)
+            return -1;
+        skip_space();
+        return pos == text.size() ? 0 : -1;
+    }
+
+private:
+    void skip_space()
+    {
+        while (pos < text.size() && (text[pos] == ' ' || text[pos] == '\t' || text[pos] == '\r' || text[pos] == '\n'))
+            pos++;
+    }
+
+    int parse_hex4(unsigned int& c)
+    {
+        if (pos + 4 > text.size())
+            return -1;
+        c = 0;
+        for (int i = 0; i < 4; i++)
+        {
+            const char h = text[pos++];
+            c <<= 4;
+            if (h >= '0' && h <= '9')
+                c |= h - '0';
+            else if (h >= 'a' && h <= 'f')
+                c |= h - 'a' + 10;
+            else if (h >= 'A' && h <= 'F')
+                c |= h - 'A' + 10;
+            else
+                return -1;
+        }
+        return 0;
+    }
+
+    int parse_string(std::string& out)
+    {
+        // after the opening quote
+        out.clear();
+        while (pos < text.size())
+        {
+            const char ch = text[pos++];
+            if (ch == '"')
+                return 0;
+            if (ch != '\\')
+            {
+                out += ch;
+                continue;
+            }
+            if (pos >= text.size())
+                return -1;
+
+            const char esc = text[pos++];
+            switch (esc)
+            {
+            case '"':
+            case '\\':
+            case '/':
+                out += esc;
+                break;
+            case 'b':
+                out += '\b';
+                break;
+            case 'f':
+                out += '\f';
+                break;
+            case 'n':
+                out += '\n';
+                break;
+            case 'r':
+                out += '\r';
+                break;
+            case 't':
+                out += '\t';
+                break;
+            case 'u':
+            {
+                unsigned int c = 0;
+                if (parse_hex4(c) != 0)
+                    return -1;
+                // a surrogate pair is two escapes
+                if (c >= 0xd800 && c < 0xdc00 && text.compare(pos, 2, "\\u") == 0)
+                {
+                    pos += 2;
+                    unsigned int low = 0;
+                    if (parse_hex4(low) != 0 || low < 0xdc00 || low >= 0xe000)
+                        return -1;
+                    c = 0x10000 + ((c - 0xd800) << 10) + (low - 0xdc00);
+                }
+                char buf[4];
+                out.append(buf, utf8_encode(c, buf));
+                break;
+            }
+            default:
+                return -1;
+            }
+        }
+        return -1;
+    }
+
+    int parse_value(JsonValue& value, int depth)
+    {
+        skip_space();
+        if (pos >= text.size() || depth > 64)
+            return -1;
+
+        const size_t start = pos;
+        const char ch = text[pos];
+        if (ch == '"')
+        {
+            pos++;
+            value.type = JsonValue::STRING;
+            return parse_string(value.str);
+        }
+
+        if (ch == '[' || ch == '{')
+        {
+            const bool object = ch == '{';
+            const char close = object ? '}' : ']';
+            value.type = object ? JsonValue::OBJECT : JsonValue::ARRAY;
+            pos++;
+            skip_space();
+            if (pos < text.size() && text[pos] == close)
+            {
+                pos++;
+                value.str = text.substr(start, pos - start);
+                return 0;
+            }
+            for (;;)
+            {
+                if (object)
+                {
+                    skip_space();
+                    if (pos >= text.size() || text[pos] != '"')
+                        return -1;
+                    pos++;
+                    std::string key;
+                    if (parse_string(key) != 0)
+                        return -1;
+                    skip_space();
+                    if (pos >= text.size() || text[pos] != ':')
+                        return -1;
+                    pos++;
+                    value.keys.push_back(key);
+                }
+                value.items.push_back(JsonValue());
+                if (parse_value(value.items.back(), depth + 1) != 0)
+                    return -1;
+                skip_space();
+                if (pos >= text.size())
+                    return -1;
+                if (text[pos] == ',')
+                {
+                    pos++;
+                    continue;
+                }
+                if (text[pos] != close)
+                    return -1;
+                pos++;
+                value.str = text.substr(start, pos - start);
+                return 0;
+            }
+        }
+
+        // numbers, true, false and null
+        while (pos < text.size() && strchr(",]} \t\r\n", text[pos]) == 0)
+            pos++;
+        if (pos == start)
+            return -1;
+        value.str = text.substr(start, pos - start);
+        if (value.str == "true" || value.str == "false" || value.str == "null")
+        {
+            value.type = JsonValue::OTHER;
+            return 0;
+        }
+        char* end = 0;
+        value.number = strtod(value.str.c_str(), &end);
+        value.type = JsonValue::NUMBER;
+        return *end == 0 ? 0 : -1;
+    }
+
+private:
+    const std::string& text;
+    size_t pos;
+};
+
+static void append_json_string(std::string& out, const std::string& s)
+{
+    out += '"';
+    for (size_t i = 0; i < s.size(); i++)
+    {
+        const unsigned char ch = s[i];
+        if (ch == '"' || ch == '\\')
+        {
+            out += '\\';
+            out += ch;
+        }
+        else if (ch == '\n')
+            out += "\\n";
+        else if (ch == '\r')
+            out += "\\r";
+        else if (ch == '\t')
+            out += "\\t";
+        else if (ch < 0x20)
+        {
+            char buf[8];
+            sprintf(buf, "\\u%04x", ch);
+            out += buf;
+        }
+        else
+            out += ch;
+    }
+    out += '"';
+}
+
+static void append_number(std::string& out, const char* name, double value)
+{
+    char buf[64];
+    sprintf(buf, "\"%s\": %.1f", name, value);
+    out += buf;
+}
+
+struct Conversation
+{
+    long long line;
+    std::string id; // json source text, empty if the line has none
+    std::vector<std::string> turns;
+    long long seed;
+    int max_len;
+    std::string error;
+};
+
+static void parse_conversation(const std::string& text, Conversation& conv)
+{
+    JsonValue root;
+    JsonParser parser(text);
+    if (parser.parse(root) != 0)
+    {
+        conv.error = "invalid json";
+        return;
+    }
+
+    if (root.type == JsonValue::STRING)
+    {
+        conv.turns.push_back(root.str);
+        return;
+    }
+    if (root.type != JsonValue::OBJECT)
+    {
+        conv.error = "a line is an object or a string";
+        return;
+    }
+
+    const JsonValue* id = root.get("id");
+    if (id)
+    {
+        conv.id.clear();
+        if (id->type == JsonValue::STRING)
+            append_json_string(conv.id, id->str);
+        else
+            conv.id = id->str;
+    }
+
+    const JsonValue* seed = root.get("seed");
+    if (seed && seed->type == JsonValue::NUMBER)
+        conv.seed = (long long)seed->number;
+    const JsonValue* max_len = root.get("max_len");
+    if (max_len && max_len->type == JsonValue::NUMBER)
+        conv.max_len = (int)max_len->number;
+
+    const JsonValue* turns = root.get("turns");
+    const JsonValue* messages = root.get("messages");
+    const JsonValue* prompt = root.get("prompt");
+    if (turns && turns->type == JsonValue::ARRAY)
+    {
+        for (size_t i = 0; i < turns->items.size(); i++)
+        {
+            if (turns->items[i].type == JsonValue::STRING)
+                conv.turns.push_back(turns->items[i].str);
+        }
+    }
+    else if (messages && messages->type == JsonValue::ARRAY)
+    {
+        // the replies of the other roles are regenerated
+        for (size_t i = 0; i < messages->items.size(); i++)
+        {
+            const JsonValue* role = messages->items[i].get("role");
+            const JsonValue* content = messages->items[i].get("content");
+            if (role && content && role->str == "user" && content->type == JsonValue::STRING)
+                conv.turns.push_back(content->str);
+        }
+    }
+    else if (prompt && prompt->type == JsonValue::STRING)
+    {
+        conv.turns.push_back(prompt->str);
+    }
+
+    if (conv.turns.empty())
+        conv.error = "no user turns";
+}
+
+static const char* status_names[] = {"running", "done", "cancelled", "expired", "failed"};
+
+struct Batch
+{
+    FILE* in;
+    FILE* out;
+    std::mutex in_lock;
+    std::mutex out_lock;
+    long long next_line;
+
+    gpt2_engine_t engine;
+    long long seed; // -1 for random
+    int max_len; // of a line without its own
+    int timeout_ms;
+    Clock::time_point start;
+
+    std::atomic<long long> done;
+    std::atomic<long long> failed;
+    std::atomic<long long> tokens;
+};
+
+// the next non empty line, false at the end of the input
+static bool read_line(Batch& batch, std::string& line, long long& line_number)
+{
+    std::lock_guard<std::mutex> g(batch.in_lock);
+    line.clear();
+    char buf[4096];
+    while (fgets(buf, sizeof(buf), batch.in))
+    {
+        line += buf;
+        if (line.empty() || line.back() != '\n')
+            continue;
+
+        batch.next_line++;
+        while (!line.empty() && (line.back() == '\n' || line.back() == '\r'))
+            line.pop_back();
+        if (line.find_first_not_of(" \t") == std::string::npos)
+        {
+            line.clear();
+            continue;
+        }
+        line_number = batch.next_line;
+        return true;
+    }
+
+    // the last line without a newline
+    if (line.find_first_not_of(" \t\r\n") == std::string::npos)
+        return false;
+    line_number = ++batch.next_line;
+    return true;
+}
+
+struct TurnTiming
+{
+    Clock::time_point submit;
+    Clock::time_point first;
+    bool has_first;
+};
+
+static void on_piece(const char*, size_t, void* userdata)
+{
+    TurnTiming* timing = (TurnTiming*)userdata;
+    if (!timing->has_first)
+    {
+        timing->first = Clock::now();
+        timing->has_first = true;
+    }
+}
+
+// one session, a conversation at a time, the scheduler batches the turns of all workers
+static void run_worker(Batch* batch)
+{
+    gpt2_session_t session = gpt2_session_create(batch->engine);
+    if (!session)
+        return;
+
+    std::string line;
+    long long line_number = 0;
+    while (read_line(*batch, line, line_number))
+    {
+        const Clock::time_point picked = Clock::now();
+
+        Conversation conv;
+        conv.line = line_number;
+        conv.seed = batch->seed >= 0 ? batch->seed + line_number : -1;
+        conv.max_len = batch->max_len;
+        parse_conversation(line, conv);
+
+        std::string result = "{\"line\": " + std::to_string(conv.line);
+        if (!conv.id.empty())
+            result += ", \"id\": " + conv.id;
+
+        if (!conv.error.empty())
+        {
+            result += ", \"status\": \"error\", \"error\": ";
+            append_json_string(result, conv.error);
+            result += "}\n";
+            batch->failed++;
+        }
+        else
+        {
+            gpt2_session_clear(session);
+            if (conv.seed >= 0)
+                gpt2_session_set_seed(session, (unsigned int)conv.seed);
+            gpt2_session_set_max_len(session, conv.max_len);
+
+            std::string replies;
+            std::string turns;
+            int status = GPT2_STREAM_DONE;
+            for (size_t i = 0; i < conv.turns.size() && status == GPT2_STREAM_DONE; i++)
+            {
+                TurnTiming timing;
+                timing.submit = Clock::now();
+                timing.has_first = false;
+                gpt2_stream_t stream = gpt2_session_submit(session, conv.turns[i].c_str(), on_piece, &timing, batch->timeout_ms);
+                if (!stream)
+                {
+                    status = GPT2_STREAM_FAILED;
+                    break;
+                }
+                status = gpt2_stream_wait(stream);
+                const Clock::time_point end = Clock::now();
+
+                const int tokens = gpt2_stream_reply_tokens(stream);
+                if (i > 0)
+                {
+                    replies += ", ";
+                    turns += ", ";
+                }
+                append_json_string(replies, gpt2_stream_reply(stream));
+                gpt2_stream_destroy(stream);
+
+                turns += '{';
+                append_number(turns, "first_ms", ms_since(timing.submit, timing.has_first ? timing.first : end));
+                turns += ", ";
+                append_number(turns, "ms", ms_since(timing.submit, end));
+                turns += ", \"tokens\": " + std::to_string(tokens) + '}';
+                batch->tokens += tokens;
+            }
+
+            result += ", \"status\": \"";
+            result += status_names[status];
+            result += "\", \"replies\": [" + replies + "], \"turns\": [" + turns + "], ";
+            append_number(result, "ms", ms_since(picked));
+            result += "}\n";
+
+            if (status == GPT2_STREAM_DONE)
+                batch->done++;
+            else
+                batch->failed++;
+        }
+
+        {
+            std::lock_guard<std::mutex> g(batch->out_lock);
+            fwrite(result.data(), 1, result.size(), batch->out);
+            fflush(batch->out);
+        }
+    }
+
+    gpt2_session_destroy(session);
+}
+
+int main(int argc, char** argv)
+{
+    if (argc < 4)
+    {
+        fprintf(stderr, "Usage: %s [model dir or gpt2.pack] [conversations.jsonl or -] [results.jsonl or -] [-sessions n] [-threads n] [-batch n] [-batch_tokens n] [-max_len n] [-seed n] [-timeout ms] [-prefix blocks] [-kv fp32|fp16|int8] [-prepack path] [-hugepages] [-numa]\n", argv[0]);
+        return -1;
+    }
+
+    int sessions = 0;
+    int num_threads = 0;
+    int max_batch = 0;
+    int max_batch_tokens = 0;
+    int prefix_blocks = 0;
+    int kv_type = GPT2_KV_FP16;
+    int placement = 0;
+    const char* prepack_path = 0;
+
+    Batch batch;
+    batch.next_line = 0;
+    batch.seed = -1;
+    // the reply limit of the chat demos
+    batch.max_len = 25;
+    batch.timeout_ms = 0;
+    batch.done = 0;
+    batch.failed = 0;
+    batch.tokens = 0;
+
+    for (int i = 4; i < argc; i++)
+    {
+        const char* arg = argv[i];
+        const char* value = i + 1 < argc ? argv[i + 1] : 0;
+        if (strcmp(arg, "-hugepages") == 0)
+            placement |= GPT2_PLACE_HUGE_PAGES;
+        else if (strcmp(arg, "-numa") == 0)
+            placement |= GPT2_PLACE_NUMA_REPLICAS;
+        else if (!value)
+        {
+            fprintf(stderr, "%s needs a value\n", arg);
+            return -1;
+        }
+        else
+        {
+            i++;
+            if (strcmp(arg, "-sessions") == 0)
+                sessions = atoi(value);
+            else if (strcmp(arg, "-threads") == 0)
+                num_threads = atoi(value);
+            else if (strcmp(arg, "-batch") == 0)
+                max_batch = atoi(value);
+            else if (strcmp(arg, "-batch_tokens") == 0)
+                max_batch_tokens = atoi(value);
+            else if (strcmp(arg, "-max_len") == 0)
+                batch.max_len = atoi(value);
+            else if (strcmp(arg, "-seed") == 0)
+                batch.seed = atoll(value);
+            else if (strcmp(arg, "-timeout") == 0)
+                batch.timeout_ms = atoi(value);
+            else if (strcmp(arg, "-prefix") == 0)
+                prefix_blocks = atoi(value);
+            else if (strcmp(arg, "-prepack") == 0)
+                prepack_path = value;
+            else if (strcmp(arg, "-kv") == 0)
+            {
+                if (strcmp(value, "fp32") == 0)
+                    kv_type = GPT2_KV_FP32;
+                else if (strcmp(value, "fp16") == 0)
+                    kv_type = GPT2_KV_FP16;
+                else if (strcmp(value, "int8") == 0)
+                    kv_type = GPT2_KV_INT8;
+                else
+                {
+                    fprintf(stderr, "unknown kv type %s\n", value);
+                    return -1;
+                }
+            }
+            else
+            {
+                fprintf(stderr, "unknown option %s\n", arg);
+                return -1;
+            }
+        }
+    }
+
+    batch.in = strcmp(argv[2], "-") == 0 ? stdin : fopen(argv[2], "rb");
+    if (!batch.in)
+    {
+        fprintf(stderr, "fopen %s failed\n", argv[2]);
+        return -1;
+    }
+    batch.out = strcmp(argv[3], "-") == 0 ? stdout : fopen(argv[3], "wb");
+    if (!batch.out)
+    {
+        fprintf(stderr, "fopen %s failed\n", argv[3]);
+        return -1;
+    }
+
+    gpt2_engine_t engine = gpt2_engine_create();
+    gpt2_engine_set_num_threads(engine, num_threads);
+    gpt2_engine_set_batch(engine, max_batch, max_batch_tokens);
+    gpt2_engine_set_kv_cache(engine, kv_type, 0);
+    gpt2_engine_set_prefix_cache(engine, prefix_blocks);
+    gpt2_engine_set_placement(engine, placement);
+    if (prepack_path)
+        gpt2_engine_set_prepack_path(engine, prepack_path);
+
+    const size_t len = strlen(argv[1]);
+    const bool package = len > 5 && strcmp(argv[1] + len - 5, ".pack") == 0;
+    if ((package ? gpt2_engine_load_package(engine, argv[1]) : gpt2_engine_load(engine, argv[1])) != 0)
+    {
+        gpt2_engine_destroy(engine);
+        return -1;
+    }
+    batch.engine = engine;
+
+    // enough conversations in flight to fill every batch of every scheduler
+    if (sessions <= 0)
+        sessions = (max_batch > 0 ? max_batch : 16) * gpt2_engine_scheduler_count(engine);
+
+    fprintf(stderr, "%d sessions on %d schedulers\n", sessions, gpt2_engine_scheduler_count(engine));
+
+    batch.start = Clock::now();
+    std::vector<std::thread> workers;
+    for (int i = 0; i < sessions; i++)
+        workers.push_back(std::thread(run_worker, &batch));
+    for (size_t i = 0; i < workers.size(); i++)
+        workers[i].join();
+
+    const double seconds = ms_since(batch.start) / 1000;
+    fprintf(stderr, "%lld done, %lld failed, %lld reply tokens in %.2f s, %.1f tokens/s\n", (long long)batch.done, (long long)batch.failed, (long long)batch.tokens, seconds, batch.tokens / seconds);
+
+    gpt2_engine_destroy(engine);
+
+    if (batch.in != stdin)
+        fclose(batch.in);
+    if (batch.out != stdout)
+        fclose(batch.out);
+
+    // a script running the batch sees that some results are missing
+    return batch.failed > 0 ? 1 : 0;
+}
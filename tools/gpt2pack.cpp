@@ -0,0 +1,98 @@
+// pack gpt2.param, the gpt2.bin parts and the vocab into one file
+//
+// g++ -O2 -std=c++17 -Icore tools/gpt2pack.cpp core/package.cpp core/model.cpp core/kvcache.cpp core/arena.cpp core/threadpool.cpp core/tokenizer.cpp core/detokenizer.cpp core/utf8.cpp core/mappedfile.cpp -o gpt2pack
+// ./gpt2pack gpt2.param vocab.txt gpt2.pack bin*
+
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+
+#include "mappedfile.h"
+#include "model.h"
+#include "package.h"
+#include "tokenizer.h"
+
+int main(int argc, char** argv)
+{
+    if (argc < 5)
+    {
+        fprintf(stderr, "Usage: %s [gpt2.param] [vocab.txt or vocab.bin] [gpt2.pack] [gpt2.bin or its parts in order ...]\n", argv[0]);
+        return -1;
+    }
+
+    MappedFile param;
+    if (param.open(argv[1]) != 0)
+        return -1;
+
+    // the split parts are simply concatenated
+    std::vector<unsigned char> bin;
+    for (int i = 4; i < argc; i++)
+    {
+        MappedFile part;
+        if (part.open(argv[i]) != 0)
+            return -1;
+        bin.insert(bin.end(), part.data(), part.data() + part.size());
+    }
+
+    Model model;
+    if (model.load((const char*)param.data(), param.size(), bin.data(), bin.size()) != 0)
+        return -1;
+    std::vector<unsigned char>().swap(bin);
+
+    std::vector<unsigned char> weights;
+    std::vector<unsigned int> checksums;
+    if (model.pack_weights(weights) != 0 || model.weight_checksums(checksums) != 0)
+        return -1;
+
+    MappedFile vocab;
+    if (vocab.open(argv[2]) != 0)
+        return -1;
+
+    std::vector<unsigned char> tokenizer_blob;
+    const size_t len = strlen(argv[2]);
+    if (len > 4 && strcmp(argv[2] + len - 4, ".txt") == 0)
+    {
+        if (Tokenizer::compile((const char*)vocab.data(), vocab.size(), tokenizer_blob) != 0)
+            return -1;
+    }
+    else
+    {
+        tokenizer_blob.assign(vocab.data(), vocab.data() + vocab.size());
+    }
+
+    const ModelConfig& config = model.config();
+    PackageInput sections[5] = {
+        {SECTION_CONFIG, &config, sizeof(config)},
+        {SECTION_PARAM, param.data(), param.size()},
+        {SECTION_TOKENIZER, tokenizer_blob.data(), tokenizer_blob.size()},
+        {SECTION_CHECKSUMS, checksums.data(), checksums.size() * sizeof(unsigned int)},
+        {SECTION_WEIGHTS, weights.data(), weights.size()},
+    };
+    if (Package::write(argv[3], sections, 5) != 0)
+        return -1;
+
+    // round trip before calling it done
+    Package package;
+    if (package.open(argv[3], true) != 0)
+        return -1;
+
+    Model packed;
+    if (packed.load(package) != 0 || packed.stream(4) != 0 || packed.wait_loaded() != 0)
+    {
+        fprintf(stderr, "packed model does not load\n");
+        return -1;
+    }
+
+    size_t tokenizer_size = 0;
+    const unsigned char* tokenizer_data = package.section(SECTION_TOKENIZER, &tokenizer_size);
+    Tokenizer tokenizer;
+    if (tokenizer.load(tokenizer_data, tokenizer_size) != 0)
+    {
+        fprintf(stderr, "packed tokenizer does not load\n");
+        return -1;
+    }
+
+    fprintf(stderr, "packed %d layers, %.1f MB of weights and %d tokens into %s\n", config.n_layer, weights.size() / 1048576.0, tokenizer.vocab_size(), argv[3]);
+
+    return 0;
+}
@@ -0,0 +1,69 @@
+// print the scratch memory plan of a forward for a given length
+//
+// g++ -O2 -std=c++17 -Icore tools/memplan.cpp core/arena.cpp core/kvcache.cpp core/model.cpp core/mappedfile.cpp core/package.cpp core/threadpool.cpp -o memplan
+// ./memplan gpt2.param gpt2.bin [max tokens] [threads]
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "kvcache.h"
+#include "model.h"
+
+static const char* phase_names[PHASE_COUNT] = {"embed", "attention", "mlp", "head"};
+
+static void print_plan(const Workspace& ws, int tokens)
+{
+    size_t unplanned = 0;
+    for (int i = 0; i < ws.buffer_count(); i++)
+        unplanned += Arena::aligned(ws.buffers()[i].bytes);
+
+    fprintf(stderr, "%d tokens, slab %.1f KB, %.1f KB without sharing\n", tokens, ws.slab_bytes() / 1024.0, unplanned / 1024.0);
+    for (int i = 0; i < ws.buffer_count(); i++)
+    {
+        const SlabBuffer& buffer = ws.buffers()[i];
+        fprintf(stderr, "  %-8s %10.1f KB at %10.1f KB  %s .. %s\n", buffer.name, buffer.bytes / 1024.0, buffer.offset / 1024.0, phase_names[buffer.first], phase_names[buffer.last]);
+    }
+    for (int i = 0; i < PHASE_COUNT; i++)
+        fprintf(stderr, "  peak in %-9s %10.1f KB\n", phase_names[i], ws.phase_bytes(i) / 1024.0);
+}
+
+int main(int argc, char** argv)
+{
+    if (argc < 3)
+    {
+        fprintf(stderr, "Usage: %s [gpt2.param] [gpt2.bin] [max tokens] [threads]\n", argv[0]);
+        return -1;
+    }
+
+    Model model;
+    if (model.load(argv[1], argv[2]) != 0)
+        return -1;
+
+    const ModelConfig& config = model.config();
+    const int max_tokens = argc > 3 ? atoi(argv[3]) : config.n_ctx;
+    const int num_threads = argc > 4 ? atoi(argv[4]) : 1;
+
+    // a whole prompt at once and one decode step
+    Workspace prefill;
+    if (prefill.reserve(config, max_tokens, num_threads) != 0)
+        return -100;
+    print_plan(prefill, max_tokens);
+
+    Workspace decode;
+    if (decode.reserve(config, 1, num_threads) != 0)
+        return -100;
+    print_plan(decode, 1);
+
+    // the kv cache of one sequence at that length, next to the scratch
+    const int kv_types[3] = {KV_FP32, KV_FP16, KV_INT8};
+    const char* kv_names[3] = {"fp32", "fp16", "int8"};
+    for (int i = 0; i < 3; i++)
+    {
+        KVPool pool;
+        pool.create(config, 16, 0, kv_types[i]);
+        const int blocks = (max_tokens + pool.block_size() - 1) / pool.block_size();
+        fprintf(stderr, "kv %s %d tokens %.1f KB\n", kv_names[i], max_tokens, (double)blocks * pool.block_bytes() / 1024.0);
+    }
+
+    return 0;
+}
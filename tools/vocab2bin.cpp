@@ -0,0 +1,53 @@
+// compile vocab.txt into the memory mapped tokenizer blob
+//
+// g++ -O2 -std=c++17 -Icore tools/vocab2bin.cpp core/tokenizer.cpp core/detokenizer.cpp core/utf8.cpp core/mappedfile.cpp -o vocab2bin
+// ./vocab2bin vocab.txt vocab.bin
+
+#include <stdio.h>
+#include <vector>
+
+#include "mappedfile.h"
+#include "tokenizer.h"
+
+int main(int argc, char** argv)
+{
+    if (argc != 3)
+    {
+        fprintf(stderr, "Usage: %s [vocab.txt] [vocab.bin]\n", argv[0]);
+        return -1;
+    }
+
+    MappedFile vocab;
+    if (vocab.open(argv[1]) != 0)
+        return -1;
+
+    std::vector<unsigned char> blob;
+    if (Tokenizer::compile((const char*)vocab.data(), vocab.size(), blob) != 0)
+        return -1;
+
+    // round trip before writing anything
+    Tokenizer tokenizer;
+    if (tokenizer.load(blob.data(), blob.size()) != 0)
+    {
+        fprintf(stderr, "compiled blob does not load\n");
+        return -1;
+    }
+
+    FILE* fp = fopen(argv[2], "wb");
+    if (!fp)
+    {
+        fprintf(stderr, "fopen %s failed\n", argv[2]);
+        return -1;
+    }
+    size_t nwrite = fwrite(blob.data(), 1, blob.size(), fp);
+    fclose(fp);
+    if (nwrite != blob.size())
+    {
+        fprintf(stderr, "write %s failed\n", argv[2]);
+        return -1;
+    }
+
+    fprintf(stderr, "vocab %d tokens -> %d bytes\n", tokenizer.vocab_size(), (int)blob.size());
+
+    return 0;
+}